@@ -0,0 +1,210 @@
+/**
+ * A language server that answers from a script instead of parsing anything.
+ *
+ * Requests are answered after a delay: with the responses of the same method in a log written by
+ * the recorder (`lspRecordTraffic`), in turn, or else with synthetic ones. A synthetic completion
+ * has a configurable number of items, each padded with documentation to a configurable size.
+ * A cancelled request is answered with the RequestCancelled error, like clangd does.
+ *
+ * Build with -DNEVER_JUDGE_BUILD_BENCH=ON, then run
+ *     fakeLanguageServer [--delay 5] [--jitter 0] [--items 200] [--payload 0] [--replay log]
+ */
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QRandomGenerator>
+#include <QSet>
+#include <QSocketNotifier>
+#include <QTimer>
+#include <unistd.h>
+
+#include "../ide/lspRecorder.h"
+
+namespace {
+
+struct Recorded {
+    QJsonObject response;
+    /** Time the server took to answer, in milliseconds */
+    int delay;
+};
+
+class FakeServer : public QObject {
+    QSocketNotifier *notifier;
+    QByteArray buffer;
+    QSet<int> cancelled;
+
+    int delay;
+    int jitter;
+    /** Use the recorded delays rather than `delay` */
+    bool recordedDelay;
+    QJsonArray completionItems;
+    /** The responses of the replayed log by method, answered in turn */
+    QHash<QString, QList<Recorded>> recorded;
+    QHash<QString, qsizetype> nextRecorded;
+
+    void readMessages();
+    void handle(const QJsonObject &message);
+    QJsonObject synthesize(const QString &method) const;
+    static void send(const QJsonObject &message);
+
+public:
+    explicit FakeServer(const QCommandLineParser &parser);
+    void loadReplay(const QString &path);
+};
+
+FakeServer::FakeServer(const QCommandLineParser &parser) {
+    delay = parser.value("delay").toInt();
+    jitter = parser.value("jitter").toInt();
+    recordedDelay = !parser.isSet("delay");
+
+    auto padding = QString(parser.value("payload").toInt(), 'x');
+    for (int i = 0, items = parser.value("items").toInt(); i < items; ++i) {
+        auto name = QString("item%1").arg(i);
+        completionItems.append(QJsonObject{{"label", name},
+                                           {"kind", 1 + i % 25},
+                                           {"sortText", QString("%1").arg(i, 8, 10, QChar('0'))},
+                                           {"insertText", name},
+                                           {"documentation", padding}});
+    }
+
+    notifier = new QSocketNotifier(STDIN_FILENO, QSocketNotifier::Read, this);
+    connect(notifier, &QSocketNotifier::activated, this, &FakeServer::readMessages);
+}
+
+void FakeServer::loadReplay(const QString &path) {
+    // pair every response with the request it answers
+    QHash<int, QPair<QString, qint64>> requests;
+    for (const auto &entry: LSPRecorder::read(path)) {
+        auto message = QJsonDocument::fromJson(entry.content).object();
+        if (!message.contains("id")) {
+            continue;
+        }
+        auto id = message["id"].toInt();
+        if (entry.direction == LSPRecorder::Sent && message.contains("method")) {
+            requests.insert(id, {message["method"].toString(), entry.time});
+        } else if (entry.direction == LSPRecorder::Received && !message.contains("method")) {
+            if (auto request = requests.take(id); !request.first.isEmpty()) {
+                auto time = static_cast<int>((entry.time - request.second) / 1000);
+                recorded[request.first].append({message, time});
+            }
+        }
+    }
+}
+
+void FakeServer::readMessages() {
+    char chunk[65536];
+    auto size = ::read(STDIN_FILENO, chunk, sizeof(chunk));
+    if (size <= 0) {
+        // the client is gone
+        notifier->setEnabled(false);
+        QCoreApplication::quit();
+        return;
+    }
+    buffer.append(chunk, size);
+    while (true) {
+        auto headerEnd = buffer.indexOf("\r\n\r\n");
+        if (headerEnd == -1) {
+            return;
+        }
+        auto lengthStart = buffer.indexOf("Content-Length:");
+        if (lengthStart == -1 || lengthStart > headerEnd) {
+            buffer.remove(0, headerEnd + 4);
+            continue;
+        }
+        auto lengthEnd = buffer.indexOf("\r\n", lengthStart);
+        auto length = buffer.mid(lengthStart + 15, lengthEnd - lengthStart - 15).trimmed().toInt();
+        if (buffer.size() < headerEnd + 4 + length) {
+            return;
+        }
+        handle(QJsonDocument::fromJson(buffer.mid(headerEnd + 4, length)).object());
+        buffer.remove(0, headerEnd + 4 + length);
+    }
+}
+
+void FakeServer::handle(const QJsonObject &message) {
+    auto method = message["method"].toString();
+    if (!message.contains("id")) {
+        if (method == "exit") {
+            QCoreApplication::quit();
+        } else if (method == "$/cancelRequest") {
+            cancelled.insert(message["params"].toObject()["id"].toInt());
+        }
+        return;
+    }
+    auto id = message["id"].toInt();
+    auto response = synthesize(method);
+    auto wait = delay;
+    if (auto replay = recorded.find(method); replay != recorded.end()) {
+        auto &next = nextRecorded[method];
+        const auto &answer = replay->at(next++ % replay->size());
+        response = answer.response;
+        if (recordedDelay) {
+            wait = answer.delay;
+        }
+    }
+    if (jitter > 0) {
+        wait += QRandomGenerator::global()->bounded(jitter + 1);
+    }
+    response["id"] = id;
+    QTimer::singleShot(wait, this, [this, id, response] {
+        if (cancelled.remove(id)) {
+            send({{"jsonrpc", "2.0"},
+                  {"id", id},
+                  {"error", QJsonObject{{"code", -32800}, {"message", "Request cancelled"}}}});
+        } else {
+            send(response);
+        }
+    });
+}
+
+QJsonObject FakeServer::synthesize(const QString &method) const {
+    QJsonValue result = QJsonValue::Null;
+    if (method == "initialize") {
+        QJsonObject capabilities = {{"textDocumentSync", 2},
+                                    {"completionProvider", QJsonObject{}},
+                                    {"definitionProvider", true}};
+        result = QJsonObject{{"capabilities", capabilities},
+                             {"serverInfo", QJsonObject{{"name", "fake"}}}};
+    } else if (method == "textDocument/completion") {
+        result = QJsonObject{{"isIncomplete", false}, {"items", completionItems}};
+    }
+    return {{"jsonrpc", "2.0"}, {"result", result}};
+}
+
+void FakeServer::send(const QJsonObject &message) {
+    auto content = QJsonDocument(message).toJson(QJsonDocument::Compact);
+    auto data = QByteArray("Content-Length: ") + QByteArray::number(content.size()) + "\r\n\r\n" +
+                content;
+    for (qsizetype written = 0; written < data.size();) {
+        auto size = ::write(STDOUT_FILENO, data.constData() + written, data.size() - written);
+        if (size <= 0) {
+            return;
+        }
+        written += size;
+    }
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    parser.addOption({"delay", "Milliseconds before each answer.", "ms", "5"});
+    parser.addOption({"jitter", "Up to this many milliseconds added to each delay.", "ms", "0"});
+    parser.addOption({"items", "Number of items of a completion.", "count", "200"});
+    parser.addOption({"payload", "Bytes of documentation of each item.", "bytes", "0"});
+    parser.addOption({"replay", "Answer with the responses of a recorded log.", "log"});
+    parser.process(app);
+
+    FakeServer server(parser);
+    if (parser.isSet("replay")) {
+        server.loadReplay(parser.value("replay"));
+    }
+    return app.exec();
+}
@@ -0,0 +1,266 @@
+/**
+ * Headless benchmark of the highlighter.
+ *
+ * Generates C, C++ and Python files of several sizes, replays edit sequences (typing, paste
+ * bursts and deletions) against them, and reports p50/p99 times of parsing, querying, a
+ * highlightBlock pass and the whole edit-to-highlight round trip, plus the peak memory.
+ *
+ * Build with -DNEVER_JUDGE_BUILD_BENCH=ON, then run
+ *     highlighterBench [--sizes 1000,10000,50000,200000] [--edits 100]
+ */
+
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QGuiApplication>
+#include <QRandomGenerator>
+#include <QTextBlock>
+#include <QTextCursor>
+#include <QTextDocument>
+#include <QTextStream>
+#include <QTimer>
+
+#include "../ide/highlighter.h"
+#include "samples.h"
+
+namespace {
+
+/** One edit of the text: `removed` characters at `position` replaced by `text` */
+struct Edit {
+    int position;
+    int removed;
+    QString text;
+};
+
+const char *C_TEMPLATE = R"(/* block %1: accumulate the values */
+static int compute_%1(const int *values, int count) {
+    int total = 0; // running sum
+    for (int i = 0; i < count; ++i) {
+        if (values[i] % 2 == 0) {
+            total += values[i] * %1;
+        } else {
+            total -= (values[i] >> 1);
+        }
+    }
+    printf("block %1: %d\n", total);
+    return total;
+}
+
+)";
+
+const char *CPP_TEMPLATE = R"(// block %1: a small class with templates and lambdas
+template<typename T>
+class Block%1 : public Base {
+    std::vector<T> items;
+
+public:
+    explicit Block%1(std::initializer_list<T> init) : items(init) {}
+
+    T sum() const {
+        return std::accumulate(items.begin(), items.end(), T{}, [](T a, T b) { return a + b; });
+    }
+
+    std::string name() const { return "block-%1"; }
+};
+
+)";
+
+const char *PYTHON_TEMPLATE = R"(# block %1: a function with comprehensions and strings
+def compute_%1(values, factor=%1):
+    """Return the weighted values of block %1."""
+    result = [v * factor for v in values if v % 2 == 0]
+    for index, value in enumerate(values):
+        if value > 100:
+            result.append({"index": index, "value": value})
+        else:
+            print(f"small value {value} at {index}")
+    return result
+
+
+)";
+
+QString generate(Language language, int lines) {
+    const char *pattern = language == Language::C     ? C_TEMPLATE
+                          : language == Language::CPP ? CPP_TEMPLATE
+                                                      : PYTHON_TEMPLATE;
+    // the block number adds no line, so every block has as many lines as the template
+    auto blockLines = QString(pattern).count('\n');
+    QString text;
+    for (qsizetype block = 0, count = 0; count < lines; ++block, count += blockLines) {
+        text += QString(pattern).arg(block);
+    }
+    return text;
+}
+
+/** A seeded sequence of single-character typing, paste bursts and deletions */
+QList<Edit> recordEdits(Language language, QString text, int count) {
+    QRandomGenerator random(42);
+    QList<Edit> edits;
+    // the edits are applied in order, so track the text they apply to
+    auto apply = [&text, &edits](const Edit &edit) {
+        text.replace(edit.position, edit.removed, edit.text);
+        edits.append(edit);
+    };
+    auto randomLine = [&text, &random] {
+        auto position = random.bounded(static_cast<int>(text.size()));
+        return static_cast<int>(text.lastIndexOf('\n', position - 1) + 1);
+    };
+
+    QString typed = language == Language::PYTHON ? "x = foo(bar[1])\n" : "x = foo(bar[1]);\n";
+    for (int i = 0; i < count; ++i) {
+        int position = randomLine();
+        for (int j = 0; j < typed.size(); ++j) {
+            apply({position + j, 0, typed.mid(j, 1)});
+        }
+    }
+    auto paste = generate(language, 40);
+    for (int i = 0; i < count; ++i) {
+        apply({randomLine(), 0, paste});
+    }
+    for (int i = 0; i < count; ++i) {
+        int removed = 1 + random.bounded(200);
+        apply({random.bounded(static_cast<int>(text.size()) - removed), removed, QString()});
+    }
+    return edits;
+}
+
+HighlightResult runJob(HighlightWorker &worker, HighlightJob job) {
+    static int revision = 0;
+    job.revision = ++revision;
+    worker.setLatestRevision(revision);
+
+    HighlightResult result;
+    auto connection = QObject::connect(&worker, &HighlightWorker::finished,
+                                       [&result](const HighlightResult &r) { result = r; });
+    worker.run(job);
+    QObject::disconnect(connection);
+    return result;
+}
+
+bool waitForResult(Highlighter *highlighter) {
+    // bracketsChanged comes with every applied result
+    QEventLoop loop;
+    bool applied = false;
+    QObject::connect(highlighter, &Highlighter::bracketsChanged, &loop, [&] {
+        applied = true;
+        loop.quit();
+    });
+    QTimer::singleShot(60000, &loop, &QEventLoop::quit);
+    loop.exec();
+    return applied;
+}
+
+void bench(QTextStream &out, Language language, int lines, int editCount) {
+    auto grammar = HighlightRegistry::instance().grammar(language);
+    if (!grammar.language) {
+        out << langName(language) << ": grammar not found, skipped\n";
+        return;
+    }
+    auto text = generate(language, lines);
+    auto edits = recordEdits(language, text, editCount);
+
+    // parse and query on the worker alone, driven synchronously
+    Samples parse, query;
+    HighlightWorker worker(grammar.language);
+    HighlightJob initial;
+    initial.reset = true;
+    initial.full = true;
+    initial.text = text;
+    initial.querySet = grammar.querySet;
+    initial.bracketQuery = grammar.bracketQuery;
+    auto first = runJob(worker, initial);
+    // the highlighter takes the start of a change from the blocks, here the text is counted
+    auto current = text;
+    for (const auto &edit: edits) {
+        HighlightJob job;
+        job.change = TextChange{edit.position, edit.removed, static_cast<int>(edit.text.size())};
+        auto before = QStringView(current).first(edit.position);
+        auto column = edit.position - before.lastIndexOf(u'\n') - 1;
+        job.changeStart = {static_cast<uint32_t>(before.count(u'\n')),
+                           static_cast<uint32_t>(column * 2)};
+        current.replace(edit.position, edit.removed, edit.text);
+        job.text = edit.text;
+        job.ranges = {{edit.position, edit.position + static_cast<int>(edit.text.size())}};
+        job.querySet = grammar.querySet;
+        job.bracketQuery = grammar.bracketQuery;
+        auto result = runJob(worker, job);
+        parse.add(result.parseTime);
+        query.add(result.queryTime);
+    }
+
+    // the highlighter on a real document, the worker in its own thread
+    Samples block, roundTrip;
+    QTextDocument document;
+    document.setPlainText(text);
+    auto *highlighter = HighlighterFactory::getHighlighter(language, &document);
+    highlighter->parseDocument();
+    bool complete = waitForResult(highlighter);
+
+    QElapsedTimer timer;
+    for (const auto &edit: edits) {
+        QTextCursor cursor(&document);
+        cursor.setPosition(edit.position);
+        cursor.setPosition(edit.position + edit.removed, QTextCursor::KeepAnchor);
+        timer.start();
+        cursor.insertText(edit.text);
+        complete = waitForResult(highlighter) && complete;
+        roundTrip.add(timer.nsecsElapsed() / 1000);
+    }
+
+    // formatBlock does not take the repaint for an edit, so only highlightBlock is timed
+    int step = qMax(1, document.blockCount() / 2000);
+    for (int i = 0; i < document.blockCount(); i += step) {
+        timer.start();
+        highlighter->formatBlock(document.findBlockByNumber(i));
+        block.add(timer.nsecsElapsed() / 1000);
+    }
+
+    auto row = [&out](const QString &name, const Samples &samples) {
+        out << QString("    %1 p50 %2 us, p99 %3 us\n")
+                       .arg(name, -12)
+                       .arg(samples.percentile(0.5), 8)
+                       .arg(samples.percentile(0.99), 8);
+    };
+    out << QString("%1, %2 lines, %3 edits%4\n")
+                   .arg(langName(language))
+                   .arg(lines)
+                   .arg(edits.size())
+                   .arg(complete ? "" : " (some results timed out)");
+    out << QString("    initial      parse %1 us, query %2 us\n")
+                   .arg(first.parseTime)
+                   .arg(first.queryTime);
+    row("parse", parse);
+    row("query", query);
+    row("highlight", block);
+    row("round trip", roundTrip);
+    out << QString("    peak memory  %1 MB\n").arg(peakMemoryKB() / 1024);
+    out.flush();
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    parser.addOption({"sizes", "Comma separated line counts of the files.", "sizes",
+                      "1000,10000,50000,200000"});
+    parser.addOption({"edits", "Number of edits of each kind.", "count", "100"});
+    parser.process(app);
+
+    QTextStream out(stdout);
+    int editCount = parser.value("edits").toInt();
+    for (auto language: {Language::C, Language::CPP, Language::PYTHON}) {
+        for (const auto &size: parser.value("sizes").split(',', Qt::SkipEmptyParts)) {
+            bench(out, language, size.toInt(), editCount);
+        }
+    }
+
+    HighlightWorker::sharedThread()->quit();
+    HighlightWorker::sharedThread()->wait();
+    return 0;
+}
@@ -0,0 +1,246 @@
+/**
+ * Headless benchmark of the language server client, against the fake server.
+ *
+ * Replays completion storms (typing with a completion request per keystroke, the superseded
+ * ones cancelled like the editor does) and bursts of concurrent requests, and reports the
+ * end-to-end latency, the throughput and how long the GUI thread was blocked meanwhile.
+ * No real language server is needed; with --replay the fake server answers like a recorded one.
+ *
+ * Build with -DNEVER_JUDGE_BUILD_BENCH=ON, then run
+ *     lspBench [--items 100,1000,10000] [--delay 5] [--storms 20] [--replay log]
+ */
+
+#include <QCommandLineParser>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QGuiApplication>
+#include <QSet>
+#include <QTextStream>
+#include <QTimer>
+#include <qcoro/qcorosignal.h>
+
+#include "../ide/lsp.h"
+#include "samples.h"
+
+namespace {
+
+class FakeLanguageServer : public LanguageServer {
+    QString program;
+    QStringList arguments;
+
+public:
+    FakeLanguageServer(QString program, QStringList arguments) :
+        program(std::move(program)), arguments(std::move(arguments)) {}
+
+    QString name() const override { return "fake"; }
+
+    QCoro::Task<bool> start() override { co_return co_await launch(program, arguments); }
+};
+
+/** Ticks every millisecond on the GUI thread, a late tick means the thread was busy */
+class StallMonitor : public QObject {
+    QTimer timer;
+    QElapsedTimer clock;
+    qint64 last = 0;
+
+public:
+    /** How late each tick was, in microseconds */
+    Samples stalls;
+
+    StallMonitor() {
+        timer.setTimerType(Qt::PreciseTimer);
+        timer.setInterval(1);
+        connect(&timer, &QTimer::timeout, this, [this] {
+            auto now = clock.nsecsElapsed() / 1000;
+            stalls.add(qMax<qint64>(0, now - last - 1000));
+            last = now;
+        });
+        clock.start();
+        timer.start();
+    }
+};
+
+struct Options {
+    QString server;
+    QStringList serverArguments;
+    int storms;
+    int keystrokes;
+    int interval;
+    int burst;
+};
+
+QCoro::Task<> sleepFor(int milliseconds) {
+    QTimer timer;
+    timer.setSingleShot(true);
+    timer.start(milliseconds);
+    co_await qCoro(&timer, &QTimer::timeout);
+}
+
+/**
+ * Wait for a completion sent when the timer started, the latency is only recorded if no later
+ * keystroke superseded it
+ */
+QCoro::Task<> timedCompletion(QElapsedTimer timer, LSPRequest<CompletionResponse> request,
+                              const QSet<int> *cancelled, Samples *latency, qint64 *items) {
+    auto response = co_await std::move(request.response);
+    if (!cancelled->contains(request.id)) {
+        latency->add(timer.nsecsElapsed() / 1000);
+        *items += response.items.size();
+    }
+}
+
+/** Send a completion and time it, `id` is set to the id of the request */
+QCoro::Task<> sendCompletion(LanguageServer *server, const LSPTextDocument &document,
+                             const LSPPosition &position, int *id, const QSet<int> *cancelled,
+                             Samples *latency, qint64 *items) {
+    QElapsedTimer timer;
+    timer.start();
+    auto request = server->completion(document, position);
+    *id = request.id;
+    return timedCompletion(timer, std::move(request), cancelled, latency, items);
+}
+
+QString generate(int lines) {
+    QString text = "#include <bits/stdc++.h>\n\nint main() {\n";
+    for (int i = 0; i < lines; ++i) {
+        text += QString("    int value%1 = %1 * 2;\n").arg(i);
+    }
+    return text + "}\n";
+}
+
+QCoro::Task<> bench(QTextStream &out, const Options &options, int itemCount) {
+    auto arguments = options.serverArguments;
+    arguments << "--items" << QString::number(itemCount);
+    // kept alive, the pool of the servers holds on to it
+    auto *server = new FakeLanguageServer(options.server, arguments);
+    if (!co_await server->open(QDir::tempPath())) {
+        out << "cannot start " << options.server << "\n";
+        out.flush();
+        co_return;
+    }
+    auto text = generate(1000);
+    LSPTextDocument document{LSPUri::fromQUrl(QDir::temp().filePath("bench.cpp")),
+                             Language::CPP, text};
+    co_await server->didOpen(document);
+    document.text.reset();
+
+    QSet<int> cancelled;
+    Samples latency;
+    qint64 items = 0;
+    StallMonitor monitor;
+
+    // typing: a completion per keystroke, each cancels the one before
+    LSPPosition position{3, 4};
+    int previous = 0;
+    for (int storm = 0; storm < options.storms; ++storm) {
+        std::vector<QCoro::Task<>> tasks;
+        for (int key = 0; key < options.keystrokes; ++key) {
+            if (key > 0) {
+                cancelled.insert(previous);
+                server->cancel(previous);
+            }
+            ++document.version;
+            LSPTextChange change{LSPRange{position, position}, "x"};
+            co_await server->didChange(document, {change});
+            ++position.character;
+            tasks.push_back(sendCompletion(server, document, position, &previous, &cancelled,
+                                           &latency, &items));
+            co_await sleepFor(options.interval);
+        }
+        for (auto &task: tasks) {
+            co_await std::move(task);
+        }
+        position = {position.line + 1, 4};
+    }
+
+    // a burst of concurrent requests, none cancelled
+    Samples burstLatency;
+    qint64 burstItems = 0;
+    QElapsedTimer burstTimer;
+    burstTimer.start();
+    std::vector<QCoro::Task<>> tasks;
+    for (int i = 0; i < options.burst; ++i) {
+        int id;
+        tasks.push_back(sendCompletion(server, document, position, &id, &cancelled,
+                                       &burstLatency, &burstItems));
+    }
+    for (auto &task: tasks) {
+        co_await std::move(task);
+    }
+    auto burstSeconds = qMax(1e-6, burstTimer.nsecsElapsed() / 1e9);
+    auto stalls = monitor.stalls;
+
+    co_await server->shutdown();
+
+    auto row = [&out](const QString &name, const Samples &samples) {
+        out << QString("    %1 p50 %2 us, p99 %3 us, max %4 us\n")
+                       .arg(name, -12)
+                       .arg(samples.percentile(0.5), 8)
+                       .arg(samples.percentile(0.99), 8)
+                       .arg(samples.percentile(1.0), 8);
+    };
+    out << QString("%1 items, %2\n").arg(itemCount).arg(options.serverArguments.join(' '));
+    row("completion", latency);
+    out << QString("    superseded   %1 of %2 requests\n")
+                   .arg(cancelled.size())
+                   .arg(options.storms * options.keystrokes);
+    row("burst", burstLatency);
+    out << QString("    throughput   %1 requests/s, %2 items/s\n")
+                   .arg(options.burst / burstSeconds, 0, 'f', 1)
+                   .arg(burstItems / burstSeconds, 0, 'f', 0);
+    row("gui stall", stalls);
+    out << QString("    peak memory  %1 MB\n").arg(peakMemoryKB() / 1024);
+    out.flush();
+}
+
+QCoro::Task<> run(QTextStream &out, Options options, QStringList itemCounts) {
+    for (const auto &count: itemCounts) {
+        co_await bench(out, options, count.toInt());
+    }
+    qApp->quit();
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    parser.addOption({"server", "The fake language server.", "path",
+                      QCoreApplication::applicationDirPath() + "/fakeLanguageServer"});
+    parser.addOption({"items", "Comma separated item counts of a completion.", "counts",
+                      "100,1000,10000"});
+    parser.addOption({"payload", "Bytes of documentation of each item.", "bytes", "0"});
+    parser.addOption({"delay", "Milliseconds the server takes to answer.", "ms", "5"});
+    parser.addOption({"jitter", "Up to this many milliseconds added to each delay.", "ms", "0"});
+    parser.addOption({"storms", "Number of typing storms.", "count", "20"});
+    parser.addOption({"keystrokes", "Keystrokes of each storm.", "count", "8"});
+    parser.addOption({"interval", "Milliseconds between the keystrokes.", "ms", "30"});
+    parser.addOption({"burst", "Number of concurrent requests of the burst.", "count", "50"});
+    parser.addOption({"replay", "Let the fake server answer like a recorded log.", "log"});
+    parser.process(app);
+
+    Options options{parser.value("server"),
+                    {"--delay", parser.value("delay"), "--jitter", parser.value("jitter"),
+                     "--payload", parser.value("payload")},
+                    parser.value("storms").toInt(),
+                    parser.value("keystrokes").toInt(),
+                    parser.value("interval").toInt(),
+                    parser.value("burst").toInt()};
+    if (parser.isSet("replay")) {
+        // the recorded delays apply unless a delay is given
+        if (!parser.isSet("delay")) {
+            options.serverArguments = {"--jitter", parser.value("jitter")};
+        }
+        options.serverArguments << "--replay" << parser.value("replay");
+    }
+
+    QTextStream out(stdout);
+    // the decoder thread of the servers stops when the event loop quits
+    QTimer::singleShot(0, &app, [&] { run(out, options, parser.value("items").split(',')); });
+    return app.exec();
+}
@@ -0,0 +1,36 @@
+#ifndef BENCH_SAMPLES_H
+#define BENCH_SAMPLES_H
+
+#include <QList>
+#include <algorithm>
+#include <sys/resource.h>
+
+/** Measured values of one kind, reported by their percentiles */
+struct Samples {
+    QList<qint64> values;
+
+    void add(qint64 value) { values.append(value); }
+
+    qint64 percentile(double p) const {
+        if (values.isEmpty()) {
+            return 0;
+        }
+        auto sorted = values;
+        std::ranges::sort(sorted);
+        auto index = qMin(sorted.size() - 1, static_cast<qsizetype>(p * sorted.size()));
+        return sorted[index];
+    }
+};
+
+/** The peak resident memory of the process */
+inline qint64 peakMemoryKB() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+#endif // BENCH_SAMPLES_H
@@ -0,0 +1,120 @@
+#include "compileDatabase.h"
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QProcess>
+#include <QStandardPaths>
+#include <QThreadPool>
+#include <QTimer>
+
+#include "../util/file.h"
+#include "cmd.h"
+#include "project.h"
+
+CompileDatabase::CompileDatabase(QObject *parent) : QObject(parent) {
+    Configs::bindHotUpdateOn(this, "runCommand", &CompileDatabase::onRunCommandChanged);
+}
+
+CompileDatabase &CompileDatabase::instance() {
+    static CompileDatabase instance;
+    return instance;
+}
+
+QString CompileDatabase::directory(const QString &root) {
+    if (root.isEmpty() || QFile::exists(root + "/compile_commands.json") ||
+        QFile::exists(root + "/build/compile_commands.json")) {
+        return {};
+    }
+    auto hash = QCryptographicHash::hash(root.toUtf8(), QCryptographicHash::Md5).toHex().left(16);
+    return QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) +
+           "/never-judge/compile-commands/" + hash;
+}
+
+QJsonObject CompileDatabase::entry(const LangFileInfo &file) {
+    static const QSet<QString> compilers = {"gcc", "g++", "cc", "c++", "clang", "clang++"};
+    // the compiler call among the steps of the run command, e.g. `g++ -std=c++17 -O2 a.cpp -o a`
+    QStringList arguments;
+    for (const auto &step: Command::runFile(file).text().split("&&")) {
+        auto tokens = QProcess::splitCommand(step.trimmed());
+        if (!tokens.isEmpty() && compilers.contains(QFileInfo(tokens.first()).fileName())) {
+            arguments = tokens;
+            break;
+        }
+    }
+    if (arguments.isEmpty()) {
+        arguments = {file.language() == Language::C ? "gcc" : "g++", file.fileName()};
+    }
+    // the output is of no interest to clangd
+    if (auto output = arguments.indexOf("-o"); output != -1) {
+        arguments.remove(output, qMin<qsizetype>(2, arguments.size() - output));
+    }
+    return {
+            {"directory", file.absolutePath()},
+            {"file", file.absoluteFilePath()},
+            {"arguments", QJsonArray::fromStringList(arguments)},
+    };
+}
+
+void CompileDatabase::write() {
+    auto dir = directory(root);
+    if (dir.isEmpty()) {
+        return;
+    }
+    auto sorted = files.values();
+    std::ranges::sort(sorted);
+    QJsonArray entries;
+    for (const auto &file: sorted) {
+        entries.append(entry(LangFileInfo(file)));
+    }
+    auto data = QJsonDocument(entries).toJson();
+    if (data == written) {
+        return;
+    }
+    QFile file(dir + "/compile_commands.json");
+    if (!QDir().mkpath(dir) || !file.open(QIODevice::WriteOnly)) {
+        qWarning() << "CompileDatabase: cannot write" << file.fileName();
+        return;
+    }
+    file.write(data);
+    written = data;
+}
+
+void CompileDatabase::generate(const QString &root) {
+    this->root = root;
+    files.clear();
+    written.clear();
+    if (directory(root).isEmpty()) {
+        return;
+    }
+    QThreadPool::globalInstance()->start([this, root] {
+        QSet<QString> found;
+        // headers are left to clangd, it infers them from the sources
+        Project::walk(root, {"*.c", "*.cpp"}, [&found](const QString &path) {
+            found.insert(path);
+            return true;
+        });
+        // the run commands are read in the GUI thread, where they are updated
+        QMetaObject::invokeMethod(this, [this, root, found] {
+            if (this->root == root) {
+                files.unite(found);
+                write();
+            }
+        });
+    });
+}
+
+void CompileDatabase::addFile(const LangFileInfo &file) {
+    auto path = file.absoluteFilePath();
+    if (root.isEmpty() || !path.startsWith(root + "/") || files.contains(path)) {
+        return;
+    }
+    files.insert(path);
+    write();
+}
+
+void CompileDatabase::onRunCommandChanged(const QJsonValue &) {
+    // after the run commands themselves are updated, which is by another slot of the change
+    QTimer::singleShot(0, this, &CompileDatabase::write);
+}
@@ -0,0 +1,41 @@
+#ifndef COMPILE_DATABASE_H
+#define COMPILE_DATABASE_H
+
+#include <QJsonObject>
+#include <QObject>
+#include <QSet>
+
+#include "language.h"
+
+/**
+ * A compile_commands.json for projects without one, e.g. loose OJ files, so that clangd parses
+ * every file with the flags of the run command instead of guessing them per file.
+ * It is kept in the cache directory, the project folder is left untouched.
+ */
+class CompileDatabase : public QObject {
+    Q_OBJECT
+
+    QString root;
+    /** The C and C++ files with an entry */
+    QSet<QString> files;
+    /** What was written last, to leave the file alone when nothing changed */
+    QByteArray written;
+
+    explicit CompileDatabase(QObject *parent = nullptr);
+    static QJsonObject entry(const LangFileInfo &file);
+    void write();
+
+private slots:
+    void onRunCommandChanged(const QJsonValue &value);
+
+public:
+    static CompileDatabase &instance();
+    /** The directory to give clangd for the root, empty if the project has a database itself */
+    static QString directory(const QString &root);
+    /** Scan the project in the background and write the database of its files */
+    void generate(const QString &root);
+    /** Add a file missing from the database, e.g. one created after the scan */
+    void addFile(const LangFileInfo &file);
+};
+
+#endif // COMPILE_DATABASE_H
@@ -0,0 +1,65 @@
+#include "diagnostics.h"
+
+#include <QJsonArray>
+
+void Diagnostic::readJson(QJsonObject json) {
+    range.readJson(json["range"].toObject());
+    // a missing severity is left to the client, take it as an error
+    severity = static_cast<Severity>(json["severity"].toInt(Error));
+    message = json["message"].toString();
+}
+
+DiagnosticTable::DiagnosticTable(QList<Diagnostic> diagnostics, std::optional<int> version) :
+    diagnostics(std::move(diagnostics)), version(version) {
+    std::ranges::stable_sort(this->diagnostics, {}, [](const Diagnostic &diagnostic) {
+        return diagnostic.range.start.line;
+    });
+    int maxEnd = -1;
+    for (const auto &diagnostic: this->diagnostics) {
+        maxEnd = qMax(maxEnd, diagnostic.range.end.line);
+        maxEndLines.append(maxEnd);
+    }
+}
+
+qsizetype DiagnosticTable::size() const { return diagnostics.size(); }
+
+QList<Diagnostic> DiagnosticTable::overlapping(int firstLine, int lastLine) const {
+    // the ones starting after the range are past this
+    auto end = std::ranges::upper_bound(diagnostics, lastLine, {}, [](const Diagnostic &d) {
+                   return d.range.start.line;
+               }) - diagnostics.begin();
+    QList<Diagnostic> found;
+    // walking back, nothing before an index ends after its max end line
+    for (auto i = end - 1; i >= 0 && maxEndLines[i] >= firstLine; --i) {
+        if (diagnostics[i].range.end.line >= firstLine) {
+            found.append(diagnostics[i]);
+        }
+    }
+    std::ranges::reverse(found);
+    return found;
+}
+
+DiagnosticStore::DiagnosticStore(QObject *parent) : QObject(parent) {}
+
+DiagnosticStore &DiagnosticStore::instance() {
+    static DiagnosticStore instance;
+    return instance;
+}
+
+void DiagnosticStore::publish(const QJsonObject &params) {
+    auto path = LSPUri{params["uri"].toString()}.toLocalFile();
+    QList<Diagnostic> diagnostics;
+    for (auto json: params["diagnostics"].toArray()) {
+        Diagnostic diagnostic;
+        diagnostic.readJson(json.toObject());
+        diagnostics.append(diagnostic);
+    }
+    std::optional<int> version;
+    if (params.contains("version")) {
+        version = params["version"].toInt();
+    }
+    tables[path] = DiagnosticTable(std::move(diagnostics), version);
+    emit diagnosticsChanged(path);
+}
+
+DiagnosticTable DiagnosticStore::table(const QString &path) const { return tables.value(path); }
@@ -0,0 +1,57 @@
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+#include <QHash>
+#include <QObject>
+
+#include "lsp.h"
+
+struct Diagnostic {
+    enum Severity { Error = 1, Warning = 2, Information = 3, Hint = 4 };
+
+    LSPRange range;
+    Severity severity = Error;
+    QString message;
+
+    void readJson(QJsonObject json);
+};
+
+/**
+ * The diagnostics of a document sorted by start line, each with the largest end line up to it,
+ * so that the ones touching a few lines are found without looking at all of them.
+ */
+class DiagnosticTable {
+    QList<Diagnostic> diagnostics;
+    QList<int> maxEndLines;
+
+public:
+    /** The version of the document they are about, if the server tells */
+    std::optional<int> version;
+
+    DiagnosticTable() = default;
+    DiagnosticTable(QList<Diagnostic> diagnostics, std::optional<int> version);
+    qsizetype size() const;
+    /** The diagnostics touching the lines [firstLine, lastLine], sorted by start */
+    QList<Diagnostic> overlapping(int firstLine, int lastLine) const;
+};
+
+/** The latest diagnostics of every document, as published by the language servers */
+class DiagnosticStore : public QObject {
+    Q_OBJECT
+
+    /** By the local path of the file, decoded from the URI as servers encode it differently */
+    QHash<QString, DiagnosticTable> tables;
+
+    explicit DiagnosticStore(QObject *parent = nullptr);
+
+signals:
+    void diagnosticsChanged(const QString &path);
+
+public:
+    static DiagnosticStore &instance();
+    /** Read the params of a textDocument/publishDiagnostics notification */
+    void publish(const QJsonObject &params);
+    DiagnosticTable table(const QString &path) const;
+};
+
+#endif // DIAGNOSTICS_H
@@ -1,20 +1,206 @@
 #include "highlighter.h"
+#include <QCoreApplication>
+#include <QElapsedTimer>
 #include <QJsonArray>
 #include <QLibrary>
-#include <qcorotimer.h>
+#include <QScopedValueRollback>
+#include <QTextBlock>
+#include <QTextCursor>
+#include <algorithm>
 #include <utility>
 
 #include "../util/file.h"
 
-// TODO: optimize the rule memory use
-Highlighter::Highlighter(const TSLanguage *language, QString langName, QTextDocument *parent) :
-    QSyntaxHighlighter(parent), language(language), langName(std::move(langName)), parsing(false) {
-    parser = ts_parser_new();
-    ts_parser_set_language(parser, language);
-    queries.clear();
-    Configs::bindHotUpdateOn(this, "highlightRules", &Highlighter::readRules);
-    Configs::instance().manuallyUpdate("highlightRules");
-    setupBracketQuery();
+QuerySet::~QuerySet() {
+    if (query)
+        ts_query_delete(query);
+}
+
+uint16_t QuerySet::intern(const QTextCharFormat &format) {
+    auto index = formats.indexOf(format);
+    if (index == -1) {
+        index = formats.size();
+        formats.append(format);
+    }
+    return static_cast<uint16_t>(index);
+}
+
+void TextChange::merge(const TextChange &next) {
+    int oldEnd = position + charsRemoved;
+    int newEnd = position + charsAdded;
+    // the end of both changes, in the text between them
+    int end = qMax(newEnd, next.position + next.charsRemoved);
+    int start = qMin(position, next.position);
+    charsRemoved = end - newEnd + oldEnd - start;
+    charsAdded = end + next.charsAdded - next.charsRemoved - start;
+    position = start;
+}
+
+QPair<int, int> TextChange::map(QPair<int, int> range) const {
+    auto [start, end] = range;
+    int removedEnd = position + charsRemoved;
+    int delta = charsAdded - charsRemoved;
+    if (end <= position) {
+        return range;
+    }
+    if (start >= removedEnd) {
+        return {start + delta, end + delta};
+    }
+    // the range overlaps the change, keep what lies outside of it
+    return {start < position ? start : position + charsAdded,
+            end > removedEnd ? end + delta : position};
+}
+
+qsizetype SpanTable::size() const { return starts.size(); }
+
+uint32_t SpanTable::start(qsizetype i) const { return starts[i]; }
+
+uint32_t SpanTable::length(qsizetype i) const { return lengths[i]; }
+
+uint16_t SpanTable::format(qsizetype i) const { return formats[i]; }
+
+void SpanTable::clear() {
+    starts.clear();
+    lengths.clear();
+    formats.clear();
+}
+
+void SpanTable::append(uint32_t start, uint32_t length, uint16_t format) {
+    starts.append(start);
+    lengths.append(length);
+    formats.append(format);
+}
+
+QPair<qsizetype, qsizetype> SpanTable::find(uint32_t from, uint32_t to) const {
+    auto first = std::ranges::lower_bound(starts, from);
+    auto last = std::lower_bound(first, starts.end(), to);
+    return {first - starts.begin(), last - starts.begin()};
+}
+
+void SpanTable::replace(qsizetype first, qsizetype last, const SpanTable &other,
+                        qsizetype otherFirst, qsizetype otherLast) {
+    auto count = otherLast - otherFirst;
+    starts.remove(first, last - first);
+    lengths.remove(first, last - first);
+    formats.remove(first, last - first);
+    starts.insert(first, count, 0);
+    lengths.insert(first, count, 0);
+    formats.insert(first, count, 0);
+    std::copy_n(other.starts.begin() + otherFirst, count, starts.begin() + first);
+    std::copy_n(other.lengths.begin() + otherFirst, count, lengths.begin() + first);
+    std::copy_n(other.formats.begin() + otherFirst, count, formats.begin() + first);
+}
+
+void SpanTable::shift(const TextChange &change) {
+    auto position = static_cast<uint32_t>(change.position);
+    auto removedEnd = position + change.charsRemoved;
+    auto [first, last] = find(position, removedEnd);
+    if (first > 0 && starts[first - 1] + lengths[first - 1] > position) {
+        --first; // the span around the position
+    }
+
+    // split the spans overlapping the change, so that none of them crosses a new line
+    SpanTable kept;
+    for (auto i = first; i < last; ++i) {
+        auto end = starts[i] + lengths[i];
+        if (starts[i] < position) {
+            kept.append(starts[i], position - starts[i], formats[i]);
+        }
+        if (end > removedEnd) {
+            kept.append(position + change.charsAdded, end - removedEnd, formats[i]);
+        }
+    }
+    for (auto i = last; i < starts.size(); ++i) {
+        starts[i] += change.charsAdded - change.charsRemoved;
+    }
+    replace(first, last, kept, 0, kept.size());
+}
+
+qsizetype BracketTable::size() const { return positions.size(); }
+
+void BracketTable::append(uint32_t position, uint32_t partner) {
+    positions.append(position);
+    partners.append(partner);
+}
+
+std::optional<int> BracketTable::partner(int position) const {
+    auto it = std::ranges::lower_bound(positions, static_cast<uint32_t>(position));
+    if (it == positions.end() || *it != static_cast<uint32_t>(position)) {
+        return std::nullopt;
+    }
+    return static_cast<int>(partners[it - positions.begin()]);
+}
+
+/** Whether the position lies in one of the sorted and disjoint ranges */
+static bool inRanges(const QList<QPair<int, int>> &ranges, int position) {
+    auto it = std::ranges::upper_bound(ranges, position, std::less{},
+                                       [](const auto &range) { return range.second; });
+    return it != ranges.end() && it->first <= position;
+}
+
+void BracketTable::replace(const QList<QPair<int, int>> &ranges, const BracketTable &found) {
+    // merge the kept pairs with the found ones, which win on the same position
+    BracketTable merged;
+    qsizetype j = 0;
+    for (qsizetype i = 0; i < positions.size(); ++i) {
+        if (inRanges(ranges, static_cast<int>(positions[i])) ||
+            inRanges(ranges, static_cast<int>(partners[i]))) {
+            continue;
+        }
+        while (j < found.size() && found.positions[j] <= positions[i]) {
+            merged.append(found.positions[j], found.partners[j]);
+            ++j;
+        }
+        if (merged.positions.isEmpty() || merged.positions.last() != positions[i]) {
+            merged.append(positions[i], partners[i]);
+        }
+    }
+    for (; j < found.size(); ++j) {
+        merged.append(found.positions[j], found.partners[j]);
+    }
+    *this = std::move(merged);
+}
+
+void BracketTable::shift(const TextChange &change) {
+    auto position = static_cast<uint32_t>(change.position);
+    auto removedEnd = position + change.charsRemoved;
+    auto map = [&](uint32_t pos) -> std::optional<uint32_t> {
+        if (pos < position) {
+            return pos;
+        }
+        if (pos >= removedEnd) {
+            return pos + change.charsAdded - change.charsRemoved;
+        }
+        return std::nullopt;
+    };
+
+    qsizetype kept = 0;
+    for (qsizetype i = 0; i < positions.size(); ++i) {
+        auto newPosition = map(positions[i]);
+        auto newPartner = map(partners[i]);
+        if (newPosition && newPartner) {
+            positions[kept] = *newPosition;
+            partners[kept] = *newPartner;
+            ++kept;
+        }
+    }
+    positions.resize(kept);
+    partners.resize(kept);
+}
+
+Highlighter::Highlighter(Language lang, QTextDocument *parent) :
+    QSyntaxHighlighter(parent), lang(lang) {
+    auto &registry = HighlightRegistry::instance();
+    auto grammar = registry.grammar(lang);
+    language = grammar.language;
+    langName = grammar.name;
+    querySet = grammar.querySet;
+    bracketQuery = grammar.bracketQuery;
+
+    worker = new HighlightWorker(language);
+    worker->moveToThread(HighlightWorker::sharedThread());
+    connect(worker, &HighlightWorker::finished, this, &Highlighter::onParseFinished);
+    connect(&registry, &HighlightRegistry::rulesChanged, this, &Highlighter::onRulesChanged);
     connect(document(), &QTextDocument::contentsChange, this, &Highlighter::onContentsChanged);
 }
 
@@ -51,168 +237,653 @@ QPair<TSLanguage *, QString> Highlighter::toTSLanguage(Language language) {
 
 Highlighter::~Highlighter() {
     disconnect(document(), &QTextDocument::contentsChange, this, &Highlighter::onContentsChanged);
-    if (tree) {
-        ts_tree_delete(tree);
+    // make a running job give up, the worker is then deleted in its own thread
+    worker->setLatestRevision(-1);
+    worker->deleteLater();
+}
+
+void Highlighter::highlightBlock(const QString &text) {
+    setFormat(0, text.length(), QTextCharFormat()); // reset format
+
+    // the spans of this block are a contiguous run in the table
+    int blockPos = currentBlock().position();
+    auto [first, last] = spans.find(blockPos, blockPos + text.length());
+    for (auto i = first; i < last; ++i) {
+        int start = static_cast<int>(spans.start(i)) - blockPos;
+        auto length = qMin<qsizetype>(spans.length(i), text.length() - start);
+        if (length > 0) {
+            setFormat(start, length, formats[spans.format(i)]);
+        }
     }
-    for (auto &[query, cursor, rule]: queries) {
-        if (cursor)
-            ts_query_cursor_delete(cursor);
-        if (query)
-            ts_query_delete(query);
+    // the semantic tokens go over, they know what tree-sitter cannot, e.g. types
+    auto [semanticFirst, semanticLast] = semanticSpans.find(blockPos, blockPos + text.length());
+    for (auto i = semanticFirst; i < semanticLast; ++i) {
+        auto type = semanticSpans.format(i);
+        if (type >= semanticFormats.size() || semanticFormats[type].properties().isEmpty()) {
+            continue;
+        }
+        int start = static_cast<int>(semanticSpans.start(i)) - blockPos;
+        int end = static_cast<int>(
+                qMin<qsizetype>(start + semanticSpans.length(i), text.length()));
+        // the token may cover several tree-sitter spans, each keeps what it does not override
+        for (int runStart = start; runStart < end;) {
+            auto merged = format(runStart);
+            int runEnd = runStart + 1;
+            while (runEnd < end && format(runEnd) == merged) {
+                ++runEnd;
+            }
+            merged.merge(semanticFormats[type]);
+            setFormat(runStart, runEnd - runStart, merged);
+            runStart = runEnd;
+        }
     }
-    if (parser)
-        ts_parser_delete(parser);
-    if (bracketCursor)
-        ts_query_cursor_delete(bracketCursor);
-    if (bracketQuery)
-        ts_query_delete(bracketQuery);
+    textNotChanged = true;
 }
 
-void Highlighter::setupBracketQuery() {
-    const char *queryPattern = "(\"(\" @left_ \")\" @right) "
-                               "(\"(\" @left_ \")\" @right) "
-                               "(\"{\" @left_ \"}\" @right) "
-                               "(\"[\" @left_ \"]\" @right)";
+std::optional<QPair<int, int>> Highlighter::matchBrackets(int cursorPos) const {
+    if (auto partner = brackets.partner(cursorPos - 1)) {
+        return QPair{cursorPos - 1, *partner};
+    }
+    return std::nullopt;
+}
 
-    uint32_t errorOffset;
-    TSQueryError errorType;
-    bracketQuery =
-            ts_query_new(language, queryPattern, strlen(queryPattern), &errorOffset, &errorType);
+/** The point after the text, which starts at the point. The column counts bytes of UTF-16 */
+static TSPoint advance(TSPoint point, QStringView text) {
+    auto lastNewline = text.lastIndexOf(u'\n');
+    if (lastNewline == -1) {
+        return {point.row, point.column + static_cast<uint32_t>(text.size()) * 2};
+    }
+    return {point.row + static_cast<uint32_t>(text.count(u'\n')),
+            static_cast<uint32_t>(text.size() - lastNewline - 1) * 2};
+}
 
-    if (!bracketQuery) {
-        qWarning() << "Failed to create bracket query for language" << langName << "at offset"
-                   << errorOffset << "with error" << errorType;
-        return;
+QString Highlighter::plainText(QString text) {
+    for (auto &ch: text) {
+        if (ch == QChar::ParagraphSeparator || ch == QChar::LineSeparator) {
+            ch = u'\n';
+        } else if (ch == QChar::Nbsp) {
+            ch = u' ';
+        }
     }
+    return text;
+}
 
-    bracketCursor = ts_query_cursor_new();
+/** Hand the text to tree-sitter without copying it */
+static const char *readUtf16(void *payload, uint32_t byteIndex, TSPoint, uint32_t *bytesRead) {
+    const auto *text = static_cast<const QString *>(payload);
+    auto position = Highlighter::toCharPosition(byteIndex);
+    if (position >= text->size()) {
+        *bytesRead = 0;
+        return "";
+    }
+    *bytesRead = static_cast<uint32_t>(text->size() - position) * 2;
+    return reinterpret_cast<const char *>(text->constData() + position);
 }
 
-void Highlighter::setCursorPosition(int pos, const QTextBlock &block) {
-    currentCursorPos = pos;
-    if (lastBlock.isValid()) {
-        rehighlightBlock(lastBlock);
+bool Highlighter::normalizeChange(int oldLength, int newLength, int position, int &charsRemoved,
+                                  int &charsAdded) {
+    bool mismatch = oldLength - charsRemoved + charsAdded != newLength ||
+                    position + charsRemoved > oldLength;
+    if (mismatch && charsRemoved > 0 && charsAdded > 0) {
+        // Qt may count the last paragraph separator in both numbers, e.g. in a rehighlight
+        --charsRemoved;
+        --charsAdded;
     }
-    rehighlightBlock(block);
-    lastBlock = block;
+    return oldLength - charsRemoved + charsAdded == newLength &&
+           position + charsRemoved <= oldLength;
 }
 
-void Highlighter::highlightBlock(const QString &text) {
-    setFormat(0, text.length(), QTextCharFormat()); // reset format
+void Highlighter::onContentsChanged(int position, int charsRemoved, int charsAdded) {
+    if (formatting) {
+        // a format-only change caused by our own rehighlight
+        return;
+    }
 
-    for (auto &result: results) {
-        int blockPos = currentBlock().position();
-        auto blockLen = text.length();
-        auto blockEnd = blockPos + blockLen;
+    if (normalizeChange(documentLength, document()->characterCount() - 1, position, charsRemoved,
+                        charsAdded)) {
+        TextChange change{position, charsRemoved, charsAdded};
+        spans.shift(change);
+        brackets.shift(change);
+        semanticSpans.shift(change);
+        for (auto &range: dirtyRanges) {
+            range = change.map(range);
+            range.second = qMax(range.first, range.second);
+        }
+        dirtyRanges.emplace_back(position, position + charsAdded);
+        for (auto &range: editedRanges) {
+            range = change.map(range);
+            range.second = qMax(range.first, range.second);
+        }
+        editedRanges.emplace_back(position, position + charsAdded);
+        if (pendingChange) {
+            pendingChange->merge(change);
+        } else {
+            pendingChange = change;
+        }
+    } else {
+        // the change cannot be mapped, fall back to a full parse
+        semanticSpans.clear();
+        semanticDropped = true;
+        editedRanges.clear();
+        reset = true;
+        fullRequery = true;
+    }
+    documentLength = document()->characterCount() - 1;
+    // a job of an older revision running on the worker gives up as soon as it can
+    worker->setLatestRevision(++revision);
+    parseDocument();
+}
 
-        for (const auto &[start, end]: result.strRanges) {
-            if (start >= blockEnd || end <= blockPos)
-                continue;
+void Highlighter::setVisibleRange(int from, int to) { visibleRange = {from, to}; }
 
-            int highlightStart = qMax(start - blockPos, 0);
-            int highlightEnd = qMin(end - blockPos, blockLen);
+void Highlighter::updateSpans(const QList<QPair<int, int>> &ranges, const SpanTable &found) {
+    QList<int> blocks;
+    auto changed = [this, &blocks](uint32_t start) {
+        blocks.append(document()->findBlock(static_cast<int>(start)).blockNumber());
+    };
 
-            if (highlightStart < highlightEnd) {
-                setFormat(highlightStart, highlightEnd - highlightStart, result.strFormat);
-            }
+    for (const auto &[from, to]: ranges) {
+        auto [first, last] = spans.find(from, to);
+        auto [foundFirst, foundLast] = found.find(from, to);
+        spans.diff(first, last, found, foundFirst, foundLast, changed);
+        spans.replace(first, last, found, foundFirst, foundLast);
+    }
+    for (const auto &[from, to]: std::exchange(editedRanges, {})) {
+        auto last = document()->findBlock(to).blockNumber();
+        for (auto block = document()->findBlock(from).blockNumber(); block <= last; ++block) {
+            blocks.append(block);
         }
     }
-    highlightBracketPairs(text);
-    textNotChanged = true;
+    rehighlightBlocks(std::move(blocks));
 }
 
-QTextCharFormat Highlighter::matchFormat(QTextCharFormat format) {
-    format.setFontWeight(QFont::Bold);
-    format.setForeground(QColor(0xFF0000));
-    return format;
+void Highlighter::rehighlightBlocks(QList<int> blocks) {
+    // only repaint the blocks whose spans really changed
+    std::ranges::sort(blocks);
+    blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+
+    QScopedValueRollback guard(formatting, true);
+    for (int number: blocks) {
+        rehighlightBlock(document()->findBlockByNumber(number));
+    }
+}
+
+void Highlighter::formatBlock(const QTextBlock &block) {
+    QScopedValueRollback guard(formatting, true);
+    rehighlightBlock(block);
+}
+
+void Highlighter::setSemanticTokens(const SpanTable &tokens, uint32_t from, uint32_t to) {
+    QList<int> blocks;
+    auto [first, last] = semanticSpans.find(from, to);
+    // tokens outside of the range would break the order of the table
+    auto [tokensFirst, tokensLast] = tokens.find(from, to);
+    semanticSpans.diff(first, last, tokens, tokensFirst, tokensLast,
+                       [this, &blocks](uint32_t start) {
+                           auto block = document()->findBlock(static_cast<int>(start));
+                           blocks.append(block.blockNumber());
+                       });
+    semanticSpans.replace(first, last, tokens, tokensFirst, tokensLast);
+    if (from == 0 && to == UINT32_MAX) {
+        semanticDropped = false;
+    }
+    rehighlightBlocks(std::move(blocks));
+}
+
+bool Highlighter::semanticTokensDropped() const { return semanticDropped; }
+
+void Highlighter::setSemanticFormats(const QList<QTextCharFormat> &formats) {
+    semanticFormats = formats;
+    if (semanticSpans.size() > 0) {
+        QScopedValueRollback guard(formatting, true);
+        rehighlight();
+    }
 }
 
-void Highlighter::highlightBracketPairs(const QString &text) {
-    if (!bracketQuery || !bracketCursor || currentCursorPos == -1)
+void Highlighter::onRulesChanged(Language changed) {
+    if (changed != lang) {
         return;
+    }
+    // the worker may still hold the old set, it is freed with the last reference
+    querySet = HighlightRegistry::instance().grammar(lang).querySet;
+    fullRequery = true;
+    parseDocument();
+}
 
-    int blockPos = currentBlock().position();
-    int cursorPosInBlock = currentCursorPos - blockPos - 1;
-    if (cursorPosInBlock < 0 || cursorPosInBlock >= text.length())
+void Highlighter::parseDocument() {
+    if (runningRevision != -1 || !querySet) {
+        // submitted again when the running job finishes
         return;
+    }
+
+    HighlightJob job;
+    job.revision = revision;
+    job.reset = reset;
+    if (reset) {
+        job.text = document()->toPlainText();
+    } else if (pendingChange) {
+        // the worker keeps its own copy of the text, it only needs what was added
+        job.change = pendingChange;
+        // the blocks know their numbers, the worker would count the lines of the whole prefix
+        auto block = document()->findBlock(pendingChange->position);
+        job.changeStart = {static_cast<uint32_t>(block.blockNumber()),
+                           static_cast<uint32_t>(pendingChange->position - block.position()) * 2};
+        QTextCursor cursor(document());
+        cursor.setPosition(pendingChange->position);
+        cursor.setPosition(pendingChange->position + pendingChange->charsAdded,
+                           QTextCursor::KeepAnchor);
+        job.text = plainText(cursor.selectedText());
+    }
+    job.full = fullRequery;
+    job.ranges = dirtyRanges;
+    job.ranges.append(visibleRange);
+    job.querySet = querySet;
+    job.bracketQuery = bracketQuery;
+
+    pendingChange.reset();
+    reset = false;
+    fullRequery = false;
+    dirtyRanges.clear();
+    runningRevision = revision;
+    QMetaObject::invokeMethod(worker, [worker = worker, job] { worker->run(job); },
+                              Qt::QueuedConnection);
+}
 
-    QChar cursorChar = text.at(cursorPosInBlock);
-    if (cursorChar != '(' && cursorChar != ')' && cursorChar != '{' && cursorChar != '}' &&
-        cursorChar != '[' && cursorChar != ']') {
+void Highlighter::onParseFinished(const HighlightResult &result) {
+    runningRevision = -1;
+    if (result.cancelled || result.revision != revision || result.querySet != querySet) {
+        // stale: drop the spans, but query their ranges again with the next job
+        fullRequery = fullRequery || result.full;
+        for (const auto &range: result.ranges) {
+            dirtyRanges.append(pendingChange ? pendingChange->map(range) : range);
+        }
+        parseDocument();
         return;
     }
 
-    auto utf8Content = document()->toPlainText().toUtf8();
+    if (result.full) {
+        spans = result.spans;
+        formats = querySet->formats;
+        brackets = result.brackets;
+        editedRanges.clear();
+        QScopedValueRollback guard(formatting, true);
+        rehighlight();
+    } else {
+        updateSpans(result.ranges, result.spans);
+        brackets.replace(result.ranges, result.brackets);
+    }
+    emit bracketsChanged();
+}
+
+int Highlighter::toCharPosition(uint32_t bytePos) { return static_cast<int>(bytePos / 2); }
 
+/* Worker */
+
+HighlightWorker::HighlightWorker(const TSLanguage *language) {
+    parser = ts_parser_new();
+    ts_parser_set_language(parser, language);
+    // parse in slices, so that a stale job can give up in time
+    ts_parser_set_timeout_micros(parser, 50000);
+    cursor = ts_query_cursor_new();
+    bracketCursor = ts_query_cursor_new();
+}
+
+HighlightWorker::~HighlightWorker() {
+    if (tree) {
+        ts_tree_delete(tree);
+    }
+    ts_query_cursor_delete(cursor);
+    ts_query_cursor_delete(bracketCursor);
+    ts_parser_delete(parser);
+}
+
+QThread *HighlightWorker::sharedThread() {
+    static QThread *thread = [] {
+        auto *thread = new QThread();
+        thread->setObjectName("HighlightWorker");
+        QObject::connect(qApp, &QCoreApplication::aboutToQuit, thread, [thread] {
+            thread->quit();
+            thread->wait();
+        });
+        thread->start();
+        return thread;
+    }();
+    return thread;
+}
+
+void HighlightWorker::setLatestRevision(int revision) { latestRevision.store(revision); }
+
+bool HighlightWorker::isStale(const HighlightJob &job) const {
+    return job.revision != latestRevision.load();
+}
+
+void HighlightWorker::applyChange(const TextChange &change, const QString &addedText,
+                                  TSPoint start) {
+    // UTF-16 takes two bytes for each position, the ends only scan the changed characters
+    auto removedEnd = change.position + change.charsRemoved;
+    TSInputEdit edit{static_cast<uint32_t>(change.position) * 2,
+                     static_cast<uint32_t>(removedEnd) * 2,
+                     static_cast<uint32_t>(change.position + change.charsAdded) * 2,
+                     start,
+                     advance(start, QStringView(source).sliced(change.position,
+                                                                change.charsRemoved)),
+                     advance(start, addedText)};
+    source.replace(change.position, change.charsRemoved, addedText);
+    if (tree) {
+        ts_tree_edit(tree, &edit);
+    }
+}
+
+QList<QPair<int, int>> HighlightWorker::lineRanges(QList<QPair<int, int>> ranges) const {
+    // extend to whole lines, which is the unit we rehighlight in
+    auto length = static_cast<int>(source.size());
+    for (auto &[from, to]: ranges) {
+        from = qBound(0, from, length);
+        to = qBound(from, to, length);
+        while (from > 0 && source[from - 1] != u'\n') {
+            --from;
+        }
+        while (to < length && source[to] != u'\n') {
+            ++to;
+        }
+        if (to < length) {
+            ++to; // the line separator
+        }
+    }
+    std::ranges::sort(ranges);
+
+    QList<QPair<int, int>> merged;
+    for (const auto &range: ranges) {
+        if (!merged.isEmpty() && range.first <= merged.last().second) {
+            merged.last().second = qMax(merged.last().second, range.second);
+        } else {
+            merged.append(range);
+        }
+    }
+    return merged;
+}
+
+BracketTable HighlightWorker::findBrackets(const HighlightJob &job,
+                                          const QList<QPair<int, int>> &ranges) {
+    BracketTable brackets;
+    if (!job.bracketQuery) {
+        return brackets;
+    }
+
+    // each side of a pair is an entry, a pair spanning two ranges is found twice
+    QList<QPair<int, int>> entries;
     TSNode root = ts_tree_root_node(tree);
-    ts_query_cursor_exec(bracketCursor, bracketQuery, root);
+    for (const auto &[from, to]: ranges) {
+        ts_query_cursor_set_byte_range(bracketCursor, from * 2, to * 2);
+        ts_query_cursor_exec(bracketCursor, job.bracketQuery, root);
+
+        TSQueryMatch match;
+        while (ts_query_cursor_next_match(bracketCursor, &match)) {
+            int left = -1, right = -1;
+            for (uint32_t i = 0; i < match.capture_count; ++i) {
+                const auto &capture = match.captures[i];
+                uint32_t length;
+                auto name = ts_query_capture_name_for_id(job.bracketQuery, capture.index, &length);
+                int position = Highlighter::toCharPosition(ts_node_start_byte(capture.node));
+                if (strcmp(name, "left_") == 0) {
+                    left = position;
+                } else if (strcmp(name, "right") == 0) {
+                    right = position;
+                }
+            }
+            if (left != -1 && right != -1 && (inRanges(ranges, left) || inRanges(ranges, right))) {
+                entries.emplace_back(left, right);
+                entries.emplace_back(right, left);
+            }
+        }
+    }
+    std::ranges::sort(entries);
+    entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+    for (const auto &[position, partner]: entries) {
+        brackets.append(position, partner);
+    }
+    return brackets;
+}
+
+void HighlightWorker::run(const HighlightJob &job) {
+    HighlightResult result;
+    result.revision = job.revision;
+    result.querySet = job.querySet;
+    result.full = job.full || job.reset || !tree;
+
+    if (job.reset) {
+        if (tree) {
+            ts_tree_delete(tree);
+            tree = nullptr;
+        }
+        source = job.text;
+    } else if (job.change) {
+        applyChange(*job.change, job.text, job.changeStart);
+    }
+    auto length = static_cast<int>(source.size());
+    QElapsedTimer timer;
+    timer.start();
+
+    TSInput input{};
+    input.payload = &source;
+    input.read = readUtf16;
+    input.encoding = TSInputEncodingUTF16;
+
+    // the old tree has already been edited, so its unchanged subtrees are reused
+    TSTree *newTree;
+    while (!(newTree = ts_parser_parse(parser, tree, input))) {
+        // timed out: give up if the text has changed meanwhile, or go on where it stopped
+        if (isStale(job)) {
+            ts_parser_reset(parser);
+            result.cancelled = true;
+            result.ranges = lineRanges(job.ranges);
+            emit finished(result);
+            return;
+        }
+    }
 
-    TSQueryMatch match;
+    auto ranges = job.ranges;
+    if (tree) {
+        // syntax changes around the edits, e.g. a new "/*" swallowing the lines below
+        uint32_t count = 0;
+        TSRange *changed = ts_tree_get_changed_ranges(tree, newTree, &count);
+        for (uint32_t i = 0; i < count; ++i) {
+            ranges.emplace_back(Highlighter::toCharPosition(changed[i].start_byte),
+                                Highlighter::toCharPosition(changed[i].end_byte));
+        }
+        free(changed);
+        ts_tree_delete(tree);
+    }
+    tree = newTree;
+    result.parseTime = timer.nsecsElapsed() / 1000;
+    timer.restart();
+    result.ranges = result.full ? QList<QPair<int, int>>{{0, length}}
+                                : lineRanges(ranges);
 
-    while (ts_query_cursor_next_match(bracketCursor, &match)) {
-        uint32_t leftPos = 0, rightPos = 0;
-        bool hasLeft = false, hasRight = false;
+    TSNode root = ts_tree_root_node(tree);
+    const auto &querySet = *job.querySet;
+    int cnt = 0;
+    for (const auto &[from, to]: result.ranges) {
+        // the rule owning each character plus one, a later rule overrides the earlier ones
+        QList<uint16_t> owners(to - from, 0);
+        if (querySet.query) {
+            // one pass yields the spans of every rule
+            ts_query_cursor_set_byte_range(cursor, from * 2, to * 2);
+            ts_query_cursor_exec(cursor, querySet.query, root);
+
+            TSQueryMatch match;
+            while (ts_query_cursor_next_match(cursor, &match)) {
+                uint16_t owner = querySet.patternRules[match.pattern_index] + 1;
+                for (uint32_t i = 0; i < match.capture_count; ++i) {
+                    TSNode node = match.captures[i].node;
+                    // Convert byte offsets to character positions
+                    int startPos =
+                            qMax(from, Highlighter::toCharPosition(ts_node_start_byte(node)));
+                    int endPos = qMin(to, Highlighter::toCharPosition(ts_node_end_byte(node)));
+                    for (int pos = startPos; pos < endPos; ++pos) {
+                        owners[pos - from] = qMax(owners[pos - from], owner);
+                    }
+                }
+                if (++cnt % 1000 == 0 && isStale(job)) {
+                    result.cancelled = true;
+                    result.spans.clear();
+                    emit finished(result);
+                    return;
+                }
+            }
+        }
 
-        for (uint32_t i = 0; i < match.capture_count; ++i) {
-            uint32_t id = match.captures[i].index;
-            TSNode node = match.captures[i].node;
-            uint32_t length = 5;
-            auto name = ts_query_capture_name_for_id(bracketQuery, id, &length);
-            if (!name) {
+        // runs of one format, cut at the line ends
+        for (int pos = from; pos < to;) {
+            auto owner = owners[pos - from];
+            if (owner == 0 || source[pos] == u'\n') {
+                ++pos;
                 continue;
             }
-            if (strcmp(name, "left_") == 0) {
-                leftPos = ts_node_start_byte(node);
-                hasLeft = true;
-            } else if (strcmp(name, "right") == 0) {
-                rightPos = ts_node_start_byte(node);
-                hasRight = true;
+            int end = pos + 1;
+            while (end < to && owners[end - from] == owner && source[end] != u'\n') {
+                ++end;
+            }
+            result.spans.append(pos, end - pos, querySet.ruleFormats[owner - 1]);
+            pos = end;
+        }
+    }
+    result.brackets = findBrackets(job, result.ranges);
+    result.queryTime = timer.nsecsElapsed() / 1000;
+    emit finished(result);
+}
+
+/* Registry */
+
+/** The format of a rule, from its foreground, background and style */
+static QTextCharFormat readFormat(const QJsonObject &obj) {
+    QTextCharFormat format;
+    if (obj.contains("foreground")) {
+        QString color = obj["foreground"].toString();
+        format.setForeground(QColor(color));
+    }
+    if (obj.contains("background")) {
+        QString color = obj["background"].toString();
+        format.setBackground(QColor(color));
+    }
+    if (obj.contains("style")) {
+        auto styles = obj["style"].toString().split(" ", Qt::SkipEmptyParts);
+        for (const auto &style: styles) {
+            if (style == "bold") {
+                format.setFontWeight(QFont::Bold);
+            } else if (style == "italic") {
+                format.setFontItalic(true);
+            } else if (style == "underline") {
+                format.setFontUnderline(true);
+            } else if (style == "strikeout") {
+                format.setFontStrikeOut(true);
             }
         }
+    }
+    return format;
+}
+
+HighlightRegistry::HighlightRegistry(QObject *parent) : QObject(parent) {
+    rules = Configs::instance().get("highlightRules");
+    Configs::bindHotUpdateOn(this, "highlightRules", &HighlightRegistry::readRules);
+    semanticRules = Configs::instance().get("semanticTokenRules").toObject();
+    Configs::bindHotUpdateOn(this, "semanticTokenRules", &HighlightRegistry::readSemanticRules);
+}
+
+HighlightRegistry::~HighlightRegistry() {
+    for (const auto &grammar: grammars) {
+        if (grammar.bracketQuery)
+            ts_query_delete(grammar.bracketQuery);
+    }
+}
+
+HighlightRegistry &HighlightRegistry::instance() {
+    static HighlightRegistry instance;
+    return instance;
+}
+
+HighlightRegistry::Grammar HighlightRegistry::grammar(Language lang) {
+    QMutexLocker locker(&mutex);
+    auto it = grammars.find(lang);
+    if (it == grammars.end()) {
+        // a grammar that fails to load is remembered as well
+        it = grammars.insert(lang, load(lang));
+    }
+    return *it;
+}
+
+HighlightRegistry::Grammar HighlightRegistry::load(Language lang) const {
+    Grammar grammar;
+    auto [language, name] = Highlighter::toTSLanguage(lang);
+    if (language == nullptr) {
+        return grammar;
+    }
+    grammar.language = language;
+    grammar.name = name;
+
+    const char *queryPattern = "(\"(\" @left_ \")\" @right) "
+                               "(\"(\" @left_ \")\" @right) "
+                               "(\"{\" @left_ \"}\" @right) "
+                               "(\"[\" @left_ \"]\" @right)";
 
-        if (hasLeft && hasRight) {
-            int leftCharPos = byteToCharPosition(leftPos, utf8Content);
-            int rightCharPos = byteToCharPosition(rightPos, utf8Content);
-
-            int left = leftCharPos - blockPos;
-            int right = rightCharPos - blockPos;
-
-            if (cursorPosInBlock == left || cursorPosInBlock == right) {
-                // FIXME: Bracket cross lines?
-                // QTextBlock block = currentBlock();
-                // bool thisLine = true;
-                //
-                // while (leftCharPos - block.position() < 0) {
-                //     block = block.previous();
-                //     thisLine = false;
-                // }
-                // block = currentBlock();
-                // while (rightCharPos - block.position() >= block.length()) {
-                //     block = block.next();
-                //     thisLine = false;
-                // }
-
-                setFormat(left, 1, matchFormat(format(left)));
-                setFormat(right, 1, matchFormat(format(right)));
-                break;
+    uint32_t errorOffset;
+    TSQueryError errorType;
+    grammar.bracketQuery =
+            ts_query_new(language, queryPattern, strlen(queryPattern), &errorOffset, &errorType);
+    if (!grammar.bracketQuery) {
+        qWarning() << "Failed to create bracket query for language" << name << "at offset"
+                   << errorOffset << "with error" << errorType;
+    }
+
+    grammar.querySet = compileRules(language, name);
+    return grammar;
+}
+
+void HighlightRegistry::readRules(const QJsonValue &jsonRules) {
+    QList<Language> changed;
+    {
+        QMutexLocker locker(&mutex);
+        rules = jsonRules;
+        for (auto it = grammars.begin(); it != grammars.end(); ++it) {
+            if (!it->language) {
+                continue;
+            }
+            // swap in a whole new set, the old one stays valid for its holders
+            if (auto set = compileRules(it->language, it->name)) {
+                it->querySet = std::move(set);
+                changed.append(it.key());
             }
         }
     }
+    for (auto lang: changed) {
+        emit rulesChanged(lang);
+    }
 }
 
+void HighlightRegistry::readSemanticRules(const QJsonValue &jsonRules) {
+    semanticRules = jsonRules.toObject();
+    emit semanticRulesChanged();
+}
 
-void Highlighter::onContentsChanged(int, int, int) { parseDocument(); }
+QList<QTextCharFormat> HighlightRegistry::semanticFormats(const QStringList &tokenTypes) const {
+    QList<QTextCharFormat> formats;
+    for (const auto &type: tokenTypes) {
+        formats.append(readFormat(semanticRules[type].toObject()));
+    }
+    return formats;
+}
 
-void Highlighter::readRules(const QJsonValue &jsonRules) {
-    if (!jsonRules.isArray()) {
+std::shared_ptr<const QuerySet> HighlightRegistry::compileRules(const TSLanguage *language,
+                                                                const QString &name) const {
+    if (!rules.isArray()) {
         qDebug() << "readRules: HighlightRules is not an array";
-        return;
+        return nullptr;
     }
 
-    QList<HighlightRule> rules;
+    QList<HighlightRule> highlightRules;
 
     // read highlight rules from JSON
-    for (const auto &array: jsonRules.toArray()) {
+    for (const auto &array: rules.toArray()) {
         auto obj = array.toObject();
         if (!obj.contains("pattern")) {
             qWarning() << "Invalid highlight rule format on: " << array.toString();
@@ -225,7 +896,7 @@ void Highlighter::readRules(const QJsonValue &jsonRules) {
                     languageJSON.isArray() ? languageJSON.toArray() : QJsonArray{languageJSON};
             bool found = false;
             for (const auto &lang: languages) {
-                if (lang.toString() == langName) {
+                if (lang.toString() == name) {
                     found = true;
                     break;
                 }
@@ -234,131 +905,64 @@ void Highlighter::readRules(const QJsonValue &jsonRules) {
                 continue;
         }
 
-        QTextCharFormat format;
-        if (obj.contains("foreground")) {
-            QString color = obj["foreground"].toString();
-            format.setForeground(QColor(color));
-        }
-        if (obj.contains("background")) {
-            QString color = obj["background"].toString();
-            format.setBackground(QColor(color));
-        }
-        if (obj.contains("style")) {
-            auto styles = obj["style"].toString().split(" ", Qt::SkipEmptyParts);
-            for (const auto &style: styles) {
-                if (style == "bold") {
-                    format.setFontWeight(QFont::Bold);
-                } else if (style == "italic") {
-                    format.setFontItalic(true);
-                } else if (style == "underline") {
-                    format.setFontUnderline(true);
-                } else if (style == "strikeout") {
-                    format.setFontStrikeOut(true);
-                }
-            }
-        }
-
+        auto format = readFormat(obj);
         auto patternsJSON = obj["pattern"];
         // if patterns is not an array, convert it to an array with one element
         auto patterns = patternsJSON.isArray() ? patternsJSON.toArray() : QJsonArray{patternsJSON};
 
         for (const auto &p: patterns) {
             auto pattern = p.toString();
-            rules.emplace_back(pattern, format);
+            highlightRules.emplace_back(pattern, format);
         }
     }
 
-    // create queries from rules
-    for (auto &[pattern, format]: rules) {
-        // We still do not support error messages
+    // compile all rules into one query
+    auto compile = [language](const QList<HighlightRule> &ruleList, QList<uint32_t> &ruleStarts) {
+        QByteArray source;
+        ruleStarts.clear();
+        for (const auto &rule: ruleList) {
+            ruleStarts.append(source.size());
+            source.append(rule.pattern.toUtf8()).append('\n');
+        }
         uint32_t errorOffset;
         TSQueryError errorType;
-        const char *ptn = pattern.toUtf8().constData();
-        auto query = ts_query_new(language, ptn, strlen(ptn), &errorOffset, &errorType);
-        if (query == nullptr) {
-            continue;
-        }
-        auto cursor = ts_query_cursor_new();
-        queries.emplace_back(query, cursor, std::move(format));
-    }
-}
-
-QCoro::Task<> Highlighter::parseDocument() {
-    if (parsing) {
-        co_return;
-    }
-
-    auto utf8Content = document()->toPlainText().toUtf8();
-    // TODO: use old tree here for better performance
-    parsing = true;
-    if (tree) {
-        ts_tree_delete(tree);
-    }
-    tree = ts_parser_parse_string(parser, nullptr, utf8Content.constData(), utf8Content.size());
-
-    TSNode root = ts_tree_root_node(tree);
-    results.clear();
-
-    int batchSize = 10000;
-    int cnt = 0;
-
-    for (auto &[query, cursor, format]: queries) {
-        ts_query_cursor_exec(cursor, query, root);
-
-        TSQueryMatch match;
-        QList<QPair<int, int>> strRanges;
-        while (ts_query_cursor_next_match(cursor, &match)) {
-            for (uint32_t i = 0; i < match.capture_count; ++i) {
-                TSNode node = match.captures[i].node;
-                uint32_t startByte = ts_node_start_byte(node);
-                uint32_t endByte = ts_node_end_byte(node);
-
-                // Convert byte offsets to character positions
-                int startPos = byteToCharPosition(startByte, utf8Content);
-                int endPos = byteToCharPosition(endByte, utf8Content);
-                strRanges.emplace_back(startPos, endPos);
+        return ts_query_new(language, source.constData(), source.size(), &errorOffset, &errorType);
+    };
+
+    QList<uint32_t> ruleStarts;
+    auto query = compile(highlightRules, ruleStarts);
+    if (query == nullptr) {
+        // We still do not support error messages, just leave out the broken rules
+        highlightRules.removeIf([language](const HighlightRule &rule) {
+            uint32_t errorOffset;
+            TSQueryError errorType;
+            auto ptn = rule.pattern.toUtf8();
+            auto query =
+                    ts_query_new(language, ptn.constData(), ptn.size(), &errorOffset, &errorType);
+            if (query == nullptr) {
+                return true;
             }
-            if (++cnt % batchSize == 0) {
-                co_await QCoro::sleepFor(std::chrono::milliseconds(100));
-            }
-        }
-
-        results.emplace_back(strRanges, format);
+            ts_query_delete(query);
+            return false;
+        });
+        query = compile(highlightRules, ruleStarts);
     }
-    rehighlight();
-    parsing = false;
-    co_return;
-}
-
-int Highlighter::byteToCharPosition(uint32_t bytePos, const QByteArray &utf8) {
-    static const QByteArray *utf8Ptr = nullptr;
-    static QList<int> byteOffsets = {}; // charPos -> bytePos
 
-    if (utf8Ptr != &utf8) {
-        // build cache
-        byteOffsets.clear();
-        for (int byteOffset = 0; byteOffset < utf8.size();) {
-            byteOffsets.append(byteOffset);
-            uchar ch = utf8[byteOffset];
-
-            if (ch < 0x80)
-                byteOffset += 1;
-            else if ((ch & 0xE0) == 0xC0)
-                byteOffset += 2;
-            else if ((ch & 0xF0) == 0xE0)
-                byteOffset += 3;
-            else if ((ch & 0xF8) == 0xF0)
-                byteOffset += 4;
-        }
-        utf8Ptr = &utf8;
+    auto set = std::make_shared<QuerySet>();
+    set->query = query;
+    for (const auto &rule: highlightRules) {
+        set->ruleFormats.append(set->intern(rule.strFormat));
     }
-
-    // use binary search with complexity O(log n)
-    auto it = std::ranges::upper_bound(byteOffsets, bytePos);
-    return static_cast<int>(it - byteOffsets.begin() - 1);
+    for (uint32_t p = 0; query && p < ts_query_pattern_count(query); ++p) {
+        // the rule whose source contains the pattern
+        auto start = ts_query_start_byte_for_pattern(query, p);
+        auto rule = std::ranges::upper_bound(ruleStarts, start) - ruleStarts.begin() - 1;
+        set->patternRules.append(static_cast<uint16_t>(rule));
+    }
+    return set;
 }
 
 Highlighter *HighlighterFactory::getHighlighter(Language language, QTextDocument *parent) {
-    auto [tsLanguage, name] = Highlighter::toTSLanguage(language);
-    return tsLanguage == nullptr ? nullptr : new Highlighter(tsLanguage, name, parent);
+    auto grammar = HighlightRegistry::instance().grammar(language);
+    return grammar.language == nullptr ? nullptr : new Highlighter(language, parent);
 };
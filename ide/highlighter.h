@@ -2,9 +2,13 @@
 #define HIGHLIGHTER_H
 
 #include <QJsonObject>
+#include <QMutex>
 #include <QSyntaxHighlighter>
 #include <QTextCharFormat>
-#include <qcorotask.h>
+#include <QThread>
+#include <atomic>
+#include <memory>
+#include <optional>
 #include <tree_sitter/api.h>
 
 #include "language.h"
@@ -14,53 +18,312 @@ struct HighlightRule {
     QTextCharFormat strFormat;
 };
 
-struct Query {
+/**
+ * All highlight rules compiled into one query, shared read-only with the worker thread.
+ * A later rule takes priority over the earlier ones where their captures overlap.
+ */
+struct QuerySet {
     TSQuery *query = nullptr;
-    TSQueryCursor *cursor = nullptr;
-    QTextCharFormat strFormat;
+    /** The rule each pattern of the query comes from */
+    QList<uint16_t> patternRules;
+    /** Index into the format table for each rule */
+    QList<uint16_t> ruleFormats;
+    /** Every distinct format once */
+    QList<QTextCharFormat> formats;
+
+    QuerySet() = default;
+    QuerySet(const QuerySet &) = delete;
+    QuerySet &operator=(const QuerySet &) = delete;
+    ~QuerySet();
+    uint16_t intern(const QTextCharFormat &format);
 };
 
-struct QueryResult {
-    QList<QPair<int, int>> strRanges;
-    QTextCharFormat strFormat;
+/** A change of the text: `charsRemoved` characters at `position` replaced by `charsAdded` ones */
+struct TextChange {
+    int position = 0;
+    int charsRemoved = 0;
+    int charsAdded = 0;
+
+    /** Merge a later change into this one, so that the result covers both */
+    void merge(const TextChange &next);
+    /** Map the range [start, end) through this change */
+    QPair<int, int> map(QPair<int, int> range) const;
+};
+
+/**
+ * Highlight spans stored as a struct of arrays and sorted by start.
+ * Spans never overlap and never cross a block, so the spans of a block are one contiguous run.
+ */
+class SpanTable {
+    QList<uint32_t> starts;
+    QList<uint32_t> lengths;
+    QList<uint16_t> formats;
+
+public:
+    qsizetype size() const;
+    uint32_t start(qsizetype i) const;
+    uint32_t length(qsizetype i) const;
+    uint16_t format(qsizetype i) const;
+    void clear();
+    void append(uint32_t start, uint32_t length, uint16_t format);
+    /** The indices [first, last) of the spans starting in [from, to) */
+    QPair<qsizetype, qsizetype> find(uint32_t from, uint32_t to) const;
+    /**
+     * Call `changed` with the start of every span that differs between [first, last) of this
+     * table and [otherFirst, otherLast) of the other one
+     */
+    template<typename F>
+    void diff(qsizetype first, qsizetype last, const SpanTable &other, qsizetype otherFirst,
+              qsizetype otherLast, F changed) const;
+    /** Replace the spans [first, last) with the spans [otherFirst, otherLast) of the other table */
+    void replace(qsizetype first, qsizetype last, const SpanTable &other, qsizetype otherFirst,
+                 qsizetype otherLast);
+    /** Follow a change of the text, the changed characters lose their format */
+    void shift(const TextChange &change);
+};
+
+template<typename F>
+void SpanTable::diff(qsizetype first, qsizetype last, const SpanTable &other, qsizetype otherFirst,
+                     qsizetype otherLast, F changed) const {
+    // both runs are sorted by start, walk them side by side
+    for (auto i = first, j = otherFirst; i < last || j < otherLast;) {
+        if (j == otherLast || (i < last && start(i) < other.start(j))) {
+            changed(start(i++));
+        } else if (i == last || other.start(j) < start(i)) {
+            changed(other.start(j++));
+        } else {
+            if (length(i) != other.length(j) || format(i) != other.format(j)) {
+                changed(start(i));
+            }
+            ++i;
+            ++j;
+        }
+    }
+}
+
+/**
+ * Matching brackets sorted by position, every bracket stored with its partner.
+ * A pair therefore has two entries, one for each side.
+ */
+class BracketTable {
+    QList<uint32_t> positions;
+    QList<uint32_t> partners;
+
+public:
+    qsizetype size() const;
+    void append(uint32_t position, uint32_t partner);
+    /** The position of the bracket matching the one at the position */
+    std::optional<int> partner(int position) const;
+    /** Replace the pairs with a side in the ranges by the found ones */
+    void replace(const QList<QPair<int, int>> &ranges, const BracketTable &found);
+    /** Follow a change of the text, a pair loses both sides if one is removed */
+    void shift(const TextChange &change);
+};
+
+struct HighlightJob {
+    int revision = 0;
+    /** With a reset the whole text, otherwise the characters added by the change */
+    QString text;
+    /** The change since the text of the previous job */
+    std::optional<TextChange> change;
+    /** Where the change starts, the row and UTF-16 byte column taken from the blocks */
+    TSPoint changeStart{};
+    /** The change cannot be mapped, so parse from scratch */
+    bool reset = false;
+    /** Query the whole document instead of the ranges */
+    bool full = false;
+    QList<QPair<int, int>> ranges;
+    std::shared_ptr<const QuerySet> querySet;
+    TSQuery *bracketQuery = nullptr;
+};
+
+struct HighlightResult {
+    int revision = 0;
+    /** Stopped because a newer revision came in, nothing is applicable */
+    bool cancelled = false;
+    bool full = false;
+    /** The character ranges that were (or should have been) queried, sorted and disjoint */
+    QList<QPair<int, int>> ranges;
+    /** The spans inside the ranges */
+    SpanTable spans;
+    /** The pairs with a side inside the ranges */
+    BracketTable brackets;
+    /** Time spent on parsing and on querying, in microseconds */
+    qint64 parseTime = 0;
+    qint64 queryTime = 0;
+    std::shared_ptr<const QuerySet> querySet;
+};
+Q_DECLARE_METATYPE(HighlightResult)
+
+/**
+ * Owns the parser, the syntax tree and the text it was parsed from.
+ * Lives in a background thread, so typing never waits for tree-sitter.
+ */
+class HighlightWorker : public QObject {
+    Q_OBJECT
+
+    TSParser *parser;
+    TSQueryCursor *cursor;
+    TSQueryCursor *bracketCursor;
+    TSTree *tree = nullptr;
+    /** The text of the tree, kept up to date with the changes of the jobs */
+    QString source;
+    /** The newest revision of the document, a job of another revision is stale */
+    std::atomic<int> latestRevision = 0;
+
+    bool isStale(const HighlightJob &job) const;
+    void applyChange(const TextChange &change, const QString &addedText, TSPoint start);
+    QList<QPair<int, int>> lineRanges(QList<QPair<int, int>> ranges) const;
+    BracketTable findBrackets(const HighlightJob &job, const QList<QPair<int, int>> &ranges);
+
+signals:
+    void finished(const HighlightResult &result);
+
+public:
+    explicit HighlightWorker(const TSLanguage *language);
+    ~HighlightWorker() override;
+    /** The thread shared by the workers of all highlighters */
+    static QThread *sharedThread();
+
+    void setLatestRevision(int revision);
+    void run(const HighlightJob &job);
+};
+
+/**
+ * Grammars and compiled rule queries of each language, shared by all highlighters.
+ * A grammar is loaded once, and its query set is only rebuilt when the rules change.
+ */
+class HighlightRegistry : public QObject {
+    Q_OBJECT
+
+public:
+    struct Grammar {
+        /** Null if the grammar cannot be loaded */
+        const TSLanguage *language = nullptr;
+        QString name;
+        TSQuery *bracketQuery = nullptr;
+        std::shared_ptr<const QuerySet> querySet;
+    };
+
+private:
+    QMap<Language, Grammar> grammars;
+    QJsonValue rules;
+    /** The format of each semantic token type, by the name of the type */
+    QJsonObject semanticRules;
+    // use mutex for threading safe
+    mutable QMutex mutex;
+
+    explicit HighlightRegistry(QObject *parent = nullptr);
+    ~HighlightRegistry() override;
+    Grammar load(Language lang) const;
+    std::shared_ptr<const QuerySet> compileRules(const TSLanguage *language,
+                                                 const QString &name) const;
+
+private slots:
+    void readRules(const QJsonValue &jsonRules);
+    void readSemanticRules(const QJsonValue &jsonRules);
+
+signals:
+    /** The query set of the language has been replaced */
+    void rulesChanged(Language lang);
+    void semanticRulesChanged();
+
+public:
+    static HighlightRegistry &instance();
+    /** The grammar of the language, loaded on first use */
+    Grammar grammar(Language lang);
+    /** The format of each token type of a server legend, empty for the types without a rule */
+    QList<QTextCharFormat> semanticFormats(const QStringList &tokenTypes) const;
 };
 
 class Highlighter : public QSyntaxHighlighter {
     Q_OBJECT
 
     // Tree-sitter members
+    Language lang;
     const TSLanguage *language;
     QString langName;
-    TSTree *tree = nullptr;
-    TSParser *parser = nullptr;
+    HighlightWorker *worker;
+
+    std::shared_ptr<const QuerySet> querySet;
+    SpanTable spans;
+    /** The format table the spans refer to */
+    QList<QTextCharFormat> formats;
 
-    QList<Query> queries;
-    QList<QueryResult> results;
+    int revision = 0;
+    int documentLength = 0;
+    /** The revision whose job is running on the worker, -1 if idle */
+    int runningRevision = -1;
+    /** The change since the text of the last submitted job */
+    std::optional<TextChange> pendingChange;
+    /** The worker has no text yet, or lost track of it */
+    bool reset = true;
+    // character ranges to query again on the next parse
+    QList<QPair<int, int>> dirtyRanges;
+    /**
+     * The characters added since the last applied result. Qt formats their blocks before the
+     * spans are shifted, so these blocks are repainted even if their spans did not change.
+     */
+    QList<QPair<int, int>> editedRanges;
+    QPair<int, int> visibleRange;
 
-    bool parsing;
+    bool fullRequery = true;
+    bool formatting = false;
 
-    int currentCursorPos = -1;
-    QTextBlock lastBlock;
     TSQuery *bracketQuery = nullptr;
-    TSQueryCursor *bracketCursor = nullptr;
+    BracketTable brackets;
+
+    /** Semantic tokens of the language server, painted over the spans of tree-sitter */
+    SpanTable semanticSpans;
+    /** By token type, the format index of a semantic span */
+    QList<QTextCharFormat> semanticFormats;
+    /** The semantic spans were cleared by a change that cannot be mapped */
+    bool semanticDropped = false;
 
-    static int byteToCharPosition(uint32_t bytePos, const QByteArray &utf8);
     void highlightBlock(const QString &text) override;
-    void setupBracketQuery();
-    void highlightBracketPairs(const QString &text);
-    static QTextCharFormat matchFormat(QTextCharFormat format);
+    void rehighlightBlocks(QList<int> blocks);
+    void updateSpans(const QList<QPair<int, int>> &ranges, const SpanTable &found);
 
 private slots:
-    void onContentsChanged(int, int, int);
-    void readRules(const QJsonValue &jsonRules);
+    void onContentsChanged(int position, int charsRemoved, int charsAdded);
+    void onParseFinished(const HighlightResult &result);
+    void onRulesChanged(Language changed);
+
+signals:
+    /** The bracket pairs have been updated, matches on the screen may be outdated */
+    void bracketsChanged();
 
 public:
     mutable bool textNotChanged = true;
-    Highlighter(const TSLanguage *language, QString langName, QTextDocument *parent);
+    Highlighter(Language lang, QTextDocument *parent);
     ~Highlighter() override;
     static QPair<TSLanguage *, QString> toTSLanguage(Language language);
-    QCoro::Task<> parseDocument();
-    void setCursorPosition(int pos, const QTextBlock &block);
+    /** Tree-sitter reads the text as UTF-16, so a position is half of the byte offset */
+    static int toCharPosition(uint32_t bytePos);
+    /** Selected text as toPlainText() would give it, so that a copy keeps up with the document */
+    static QString plainText(QString text);
+    /**
+     * Fix up a contentsChange of a text of `oldLength` that now has `newLength` characters
+     * @return false if the change cannot be mapped onto the old text
+     */
+    static bool normalizeChange(int oldLength, int newLength, int position, int &charsRemoved,
+                                int &charsAdded);
+    /** Schedule a parse of the current text on the worker */
+    void parseDocument();
+    /** The bracket before the cursor and its partner, which may be on another line */
+    std::optional<QPair<int, int>> matchBrackets(int cursorPos) const;
+    /** Format the block again without taking it for an edit, e.g. to time highlightBlock */
+    void formatBlock(const QTextBlock &block);
+    /** Tell which characters are on the screen, they are refreshed on every parse */
+    void setVisibleRange(int from, int to);
+    /**
+     * Replace the semantic tokens starting in [from, to), only the blocks whose tokens changed
+     * are repainted
+     */
+    void setSemanticTokens(const SpanTable &tokens, uint32_t from = 0, uint32_t to = UINT32_MAX);
+    void setSemanticFormats(const QList<QTextCharFormat> &formats);
+    /** The semantic tokens were dropped since they were all set, a part is not enough then */
+    bool semanticTokensDropped() const;
 };
 class HighlighterFactory {
 public:
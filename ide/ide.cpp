@@ -1,5 +1,12 @@
 #include "ide.h"
 
+#include <QCoreApplication>
+#include <QThreadPool>
+
+#include "compileDatabase.h"
+#include "highlighter.h"
+#include "lsp.h"
+
 IDE::IDE() = default;
 
 void IDE::setProject(const Project &project) {
@@ -9,3 +16,25 @@ void IDE::setProject(const Project &project) {
 
 Project &IDE::curProject() { return project; }
 
+void IDE::preload(const Project &project) {
+    // the registry receives config updates, so it has to be created in the GUI thread
+    HighlightRegistry::instance();
+    // before clangd starts, which reads it on the first open file
+    CompileDatabase::instance().generate(project.getRoot());
+    QThreadPool::globalInstance()->start([project] {
+        auto languages = project.scanLanguages();
+        for (auto language: languages) {
+            HighlightRegistry::instance().grammar(language);
+        }
+        // the servers own their processes, start them in the GUI thread
+        QMetaObject::invokeMethod(
+                qApp,
+                [languages] {
+                    for (auto language: languages) {
+                        LanguageServers::get(language);
+                    }
+                },
+                Qt::QueuedConnection);
+    });
+}
+
@@ -10,6 +10,8 @@ public:
     IDE();
     void setProject(const Project &project);
     Project& curProject();
+    /** Load the grammars and start the language servers of the project in the background */
+    static void preload(const Project &project);
 };
 
 
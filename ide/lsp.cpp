@@ -1,16 +1,32 @@
 #include "lsp.h"
 
+#include <QDateTime>
+#include <QFile>
 #include <QJsonArray>
 #include <QJsonDocument>
+#include <QThread>
+#include <QTimer>
 #include <qcoreapplication.h>
+#include <qcoro/qcorofuture.h>
 #include <qcoro/qcoroprocess.h>
+#include <qcoro/qcorosignal.h>
+
+#include "../util/file.h"
+#include "compileDatabase.h"
+#include "diagnostics.h"
 
 // FIXME: this is linux only...?
 
 LSPUri LSPUri::fromQUrl(const QUrl &url) { return {QString("file://%1").arg(url.toEncoded())}; }
 
+LSPUri LSPUri::fromLocalFile(const QString &path) {
+    return {QString::fromUtf8(QUrl::fromLocalFile(path).toEncoded())};
+}
+
 QUrl LSPUri::toQUrl() const { return QUrl::fromPercentEncoding(uri.mid(7).toUtf8()); }
 
+QString LSPUri::toLocalFile() const { return QUrl(uri).toLocalFile(); }
+
 QJsonObject LSPTextDocument::toJson() const {
     static QMap<Language, QString> languageMap{
             {Language::C, "c"}, {Language::CPP, "cpp"}, {Language::PYTHON, "python"}};
@@ -41,11 +57,39 @@ void LSPRange::readJson(QJsonObject json) {
 
 QJsonObject LSPPosition::toJson() const { return {{"line", line}, {"character", character}}; }
 
+LSPPosition LSPPosition::after(QStringView text) const {
+    auto lastNewline = text.lastIndexOf(u'\n');
+    if (lastNewline == -1) {
+        return {line, character + static_cast<int>(text.size())};
+    }
+    return {line + static_cast<int>(text.count(u'\n')),
+            static_cast<int>(text.size() - lastNewline - 1)};
+}
+
+QJsonObject LSPRange::toJson() const { return {{"start", start.toJson()}, {"end", end.toJson()}}; }
+
+QJsonObject LSPTextChange::toJson() const {
+    QJsonObject obj{{"text", text}};
+    if (range) {
+        obj["range"] = range->toJson();
+    }
+    return obj;
+}
+
 std::pair<QString, QJsonValue> LSPPosition::toEntry() const { return {"position", toJson()}; }
 
 void InitializeResponse::parseJson(const QJsonObject &response) {
     // check the necessary keys
     ok = response.contains("id") && response.contains("jsonrpc") && response.contains("result");
+    capabilities = response["result"].toObject()["capabilities"].toObject();
+}
+
+void ShutdownResponse::parseJson(const QJsonObject & /*response*/) {
+    // the result is null, nothing to read
+}
+
+void DocumentSymbolResponse::parseJson(const QJsonObject &response) {
+    count = response["result"].toArray().size();
 }
 
 void CompletionResponse::parseJson(const QJsonObject &response) {
@@ -54,14 +98,72 @@ void CompletionResponse::parseJson(const QJsonObject &response) {
     const auto &jsonItems = result["items"].toArray();
     for (auto jsonItem: jsonItems) {
         auto item = jsonItem.toObject();
+        auto insertText = item["insertText"].toString();
+        if (!insertText.startsWith(prefix)) {
+            continue;
+        }
         auto label = item["label"].toString();
         auto kind = static_cast<CompletionItem::ItemKind>(item["kind"].toInt());
         auto sortText = item["sortText"].toString();
-        auto insertText = item["insertText"].toString();
         items.emplace_back(label, kind, sortText, insertText);
     }
 }
 
+/** The packed integers of semantic tokens */
+static QList<uint32_t> readTokenData(const QJsonArray &array) {
+    QList<uint32_t> data;
+    data.reserve(array.size());
+    for (const auto &value: array) {
+        data.append(static_cast<uint32_t>(value.toInteger()));
+    }
+    return data;
+}
+
+void SemanticTokensResponse::parseJson(const QJsonObject &response) {
+    auto result = response["result"].toObject();
+    ok = !result.isEmpty();
+    resultId = result["resultId"].toString();
+    full = result.contains("data");
+    if (full) {
+        data = readTokenData(result["data"].toArray());
+        return;
+    }
+    for (auto json: result["edits"].toArray()) {
+        auto edit = json.toObject();
+        edits.append({edit["start"].toInt(), edit["deleteCount"].toInt(),
+                      readTokenData(edit["data"].toArray())});
+    }
+}
+
+void SemanticTokensResponse::applyTo(QList<uint32_t> &previous) const {
+    // every edit refers to the previous data, so apply them from the back
+    auto sorted = edits;
+    std::ranges::sort(sorted, std::ranges::greater{}, &SemanticTokensEdit::start);
+    for (const auto &edit: sorted) {
+        auto start = qMin<qsizetype>(edit.start, previous.size());
+        previous.remove(start, qMin<qsizetype>(edit.deleteCount, previous.size() - start));
+        previous.insert(start, edit.data.size(), 0);
+        std::ranges::copy(edit.data, previous.begin() + start);
+    }
+}
+
+std::optional<QList<QPair<qsizetype, qsizetype>>> SemanticTokensResponse::changedTokens() const {
+    auto sorted = edits;
+    std::ranges::sort(sorted, {}, &SemanticTokensEdit::start);
+    QList<QPair<qsizetype, qsizetype>> tokens;
+    // the starts refer to the previous data, the earlier edits move the later ones
+    qsizetype moved = 0;
+    for (const auto &edit: sorted) {
+        if (edit.start % 5 != 0 || edit.deleteCount % 5 != 0 || edit.data.size() % 5 != 0) {
+            return std::nullopt;
+        }
+        auto first = (edit.start + moved) / 5;
+        tokens.append({first, first + edit.data.size() / 5});
+        moved += edit.data.size() - edit.deleteCount;
+    }
+    return tokens;
+}
+
 void DefinitionResponse::parseJson(const QJsonObject &response) {
     items.clear();
     if (!response.contains("result")) {
@@ -79,7 +181,24 @@ void DefinitionResponse::parseJson(const QJsonObject &response) {
     }
 }
 
-bool isNotification(LSPRequestMethod method) { return method == DidOpen; }
+void WorkspaceSymbolResponse::parseJson(const QJsonObject &response) {
+    for (auto json: response["result"].toArray()) {
+        auto obj = json.toObject();
+        // a WorkspaceSymbol may leave out the range of its location
+        auto location = obj["location"].toObject();
+        LSPRange range{};
+        if (location.contains("range")) {
+            range.readJson(location["range"].toObject());
+        }
+        items.append({obj["name"].toString(), obj["kind"].toInt(), obj["containerName"].toString(),
+                      {LSPUri(location["uri"].toString()), range}});
+    }
+}
+
+bool isNotification(LSPRequestMethod method) {
+    return method == Initialized || method == Exit || method == CancelRequest ||
+           method == DidOpen || method == DidChange || method == DidSave || method == DidClose;
+}
 
 QString LanguageServer::commentPrefix(Language language) {
     switch (language) {
@@ -96,8 +215,14 @@ QString LanguageServer::commentPrefix(Language language) {
 /* Language Server */
 const QMap<LSPRequestMethod, QString> methodMap = {
         {Initialize, "initialize"},
+        {Initialized, "initialized"},
         {Shutdown, "shutdown"},
+        {Exit, "exit"},
+        {CancelRequest, "$/cancelRequest"},
         {DidOpen, "textDocument/didOpen"},
+        {DidChange, "textDocument/didChange"},
+        {DidSave, "textDocument/didSave"},
+        {DidClose, "textDocument/didClose"},
         {Completion, "textDocument/completion"},
         {Definition, "textDocument/definition"},
         {Hover, "textDocument/hover"},
@@ -105,67 +230,465 @@ const QMap<LSPRequestMethod, QString> methodMap = {
         {Formatting, "textDocument/formatting"},
         {Rename, "textDocument/rename"},
         {PublishDiagnostics, "textDocument/publishDiagnostics"},
-        {DocumentSymbol, "textDocument/documentSymbol"}};
-
+        {DocumentSymbol, "textDocument/documentSymbol"},
+        {SemanticTokensFull, "textDocument/semanticTokens/full"},
+        {SemanticTokensDelta, "textDocument/semanticTokens/full/delta"},
+        {WorkspaceSymbol, "workspace/symbol"}};
 
-void LanguageServer::sendRequest(LSPRequestMethod method, const QJsonObject &payload) const {
-    static int requestId = 0;
 
+int LanguageServer::sendRequest(LSPRequestMethod method, const QJsonObject &payload) const {
     QJsonObject request;
     request["jsonrpc"] = "2.0";
+    int id = 0;
     if (!isNotification(method)) {
-        request["id"] = ++requestId;
+        id = ++nextId;
+        request["id"] = id;
     }
     request["method"] = methodMap[method];
     request["params"] = payload;
 
-    // write the request to the process stdin
-    QJsonDocument doc(request);
-    auto data = doc.toJson().replace("\n", "");
-    auto header = QString("Content-Length: %1\r\n\r\n").arg(QString::number(data.size()));
-    auto content = header.toUtf8() + data;
-    // qDebug() << content;
-    process->write(content);
+    write(QJsonDocument(request).toJson(QJsonDocument::Compact));
+    lastActivity.restart();
+    return id;
+}
+
+void LanguageServer::write(const QByteArray &content) const {
+    if (!isRunning()) {
+        return;
+    }
+    if (recorder) {
+        recorder->record(LSPRecorder::Sent, content);
+    }
+    process->write(QString("Content-Length: %1\r\n\r\n").arg(content.size()).toUtf8() + content);
+}
+
+template<std::derived_from<LSPResponse> R>
+LSPRequest<R> LanguageServer::request(LSPRequestMethod method, const QJsonObject &payload,
+                                      R response) const {
+    auto promise = std::make_shared<QPromise<QJsonObject>>();
+    promise->start();
+    QElapsedTimer timer;
+    if (!isRunning()) {
+        // shut down when idle or given up after crashes, nobody would ever answer
+        promise->addResult(QJsonObject{{"error", "server not running"}});
+        promise->finish();
+        return {0, receive(promise, timer, std::move(response))};
+    }
+    if (method != Shutdown) {
+        timer.start(); // the round trip of a shutdown is no answer to the user
+    }
+    int id = sendRequest(method, payload);
+    pending.insert(id, promise);
+    expire(id, REQUEST_TIMEOUT);
+    return {id, receive(promise, timer, std::move(response))};
+}
+
+template<std::derived_from<LSPResponse> R>
+QCoro::Task<R> LanguageServer::receive(std::shared_ptr<QPromise<QJsonObject>> promise,
+                                       QElapsedTimer timer, R response) const {
+    auto json = co_await promise->future();
+    if (json.contains("error")) {
+        if (json["error"] != "cancelled") {
+            qWarning() << "Response error:" << json["error"];
+        }
+        co_return response;
+    }
+    // only answers count, a single timeout would swamp the average
+    if (timer.isValid()) {
+        recordLatency(timer.elapsed());
+    }
+    // thousands of completion items take a while to convert
+    auto parsed = std::make_shared<QPromise<R>>();
+    parsed->start();
+    QMetaObject::invokeMethod(decoder, [json, parsed, response = std::move(response)]() mutable {
+        response.parseJson(json);
+        parsed->addResult(std::move(response));
+        parsed->finish();
+    });
+    co_return co_await parsed->future();
+}
 
-    // TODO: return the request ID and make sure of the corresponding between request and response
+template<std::derived_from<LSPResponse> R>
+LSPRequest<> LanguageServer::streamRequest(LSPRequestMethod method, QJsonObject payload,
+                                           std::function<void(const R &)> chunk) const {
+    auto token = QString("partial-%1").arg(++nextToken);
+    payload["partialResultToken"] = token;
+    // no chunk can come before the token is registered, the messages are read later
+    auto sent = request<R>(method, payload);
+    PartialResult partial{.id = sent.id};
+    partial.receive = [decoder = decoder, chunk](const QJsonValue &value) {
+        // converted in the decoder thread like a response, thousands of locations take a while
+        QMetaObject::invokeMethod(decoder, [chunk, value] {
+            R response;
+            response.parseJson({{"result", value}});
+            // posted before the final response is parsed, so the chunks still come first
+            QMetaObject::invokeMethod(qApp, [chunk, response] { chunk(response); });
+        });
+    };
+    partial.lastChunk.start();
+    partialResults.insert(token, partial);
+    return {sent.id, finishStream(token, std::move(sent.response), std::move(chunk))};
 }
 
 template<std::derived_from<LSPResponse> R>
-QCoro::Task<R> LanguageServer::waitResponse() const {
-    auto pw = qCoro(process); // Coroutine wrapper for QProcess
-    co_await pw.waitForReadyRead(3000);
+QCoro::Task<> LanguageServer::finishStream(QString token, QCoro::Task<R> task,
+                                           std::function<void(const R &)> chunk) const {
+    // the chunks come before the response, which has the rest of the results
+    auto response = co_await std::move(task);
+    partialResults.remove(token);
+    chunk(response);
+}
+
+QThread *LanguageServer::decoderThread() {
+    static QThread *thread = [] {
+        auto *thread = new QThread();
+        thread->setObjectName("LanguageServerDecoder");
+        QObject::connect(qApp, &QCoreApplication::aboutToQuit, thread, [thread] {
+            thread->quit();
+            thread->wait();
+        });
+        thread->start();
+        return thread;
+    }();
+    return thread;
+}
+
+void LanguageServer::readMessages() {
+    buffer.append(process->readAllStandardOutput());
+    lastActivity.restart();
     while (true) {
-        QByteArray line = co_await pw.readLine();
-        if (line.startsWith("Content-Length:")) {
-            int length = line.mid(16).toInt();
-
-            // Skip empty line
-            line = co_await pw.readLine();
-            if (line.startsWith("Content-Type:")) {
-                // pylsp has the content type line
-                co_await pw.readLine();
+        // the header ends with an empty line, pylsp sends a Content-Type line as well
+        auto headerEnd = buffer.indexOf("\r\n\r\n", bufferOffset);
+        if (headerEnd == -1) {
+            break;
+        }
+        qsizetype length = -1;
+        for (auto lineStart = bufferOffset; lineStart < headerEnd;) {
+            auto lineEnd = buffer.indexOf("\r\n", lineStart);
+            QByteArrayView line(buffer.constData() + lineStart, lineEnd - lineStart);
+            if (line.startsWith("Content-Length:")) {
+                length = line.sliced(15).trimmed().toLongLong();
             }
+            lineStart = lineEnd + 2;
+        }
+        auto contentStart = headerEnd + 4;
+        if (length < 0) {
+            qWarning() << "LanguageServer: message without Content-Length";
+            bufferOffset = contentStart;
+            continue;
+        }
+        if (buffer.size() - contentStart < length) {
+            break; // wait for the rest of the content
+        }
 
-            QByteArray data = co_await pw.read(length);
-            QJsonDocument doc = QJsonDocument::fromJson(data);
-            QJsonObject json = doc.object();
+        // parse in the decoder thread, which keeps the order of the messages
+        auto content = buffer.mid(contentStart, length);
+        bufferOffset = contentStart + length;
+        if (recorder) {
+            recorder->record(LSPRecorder::Received, content);
+        }
+        QMetaObject::invokeMethod(decoder, [this, content] {
+            auto message = QJsonDocument::fromJson(content).object();
+            QMetaObject::invokeMethod(this, [this, message] { dispatch(message); });
+        });
+    }
+    // drop the handled messages once per read
+    buffer.remove(0, bufferOffset);
+    bufferOffset = 0;
+}
 
-            if (!json.contains("id")) {
-                // skip notifications
-                // if (json["method"] == "textDocument/publishDiagnostics") {
-                // qDebug() << "Received diagnostics:" << json["params"];
-                // }
-                continue;
+void LanguageServer::dispatch(const QJsonObject &message) {
+    if (!message.contains("method")) {
+        if (auto promise = pending.take(message["id"].toInt())) {
+            promise->addResult(message);
+            promise->finish();
+        }
+        return;
+    }
+
+    auto method = message["method"].toString();
+    auto params = message["params"].toObject();
+    if (!message.contains("id")) {
+        if (method == "$/progress") {
+            if (auto partial = partialResults.find(params["token"].toString());
+                partial != partialResults.end()) {
+                partial->lastChunk.restart();
+                partial->receive(params["value"]);
+                return;
             }
-            R response;
-            if (json.contains("error")) {
-                qWarning() << "Response error:" << json["error"];
-            } else {
-                response.parseJson(json);
+        }
+        emit notificationReceived(method, params);
+        return;
+    }
+    // a request from the server, which may wait for the answer
+    if (method == "workspace/configuration") {
+        // no settings for any of the items
+        QJsonArray settings;
+        for (qsizetype i = 0; i < params["items"].toArray().size(); ++i) {
+            settings.append(QJsonValue::Null);
+        }
+        sendResponse(message["id"], settings);
+    } else {
+        sendResponse(message["id"], QJsonValue::Null);
+    }
+}
+
+void LanguageServer::sendResponse(const QJsonValue &id, const QJsonValue &result) const {
+    QJsonObject response{{"jsonrpc", "2.0"}, {"id", id}, {"result", result}};
+    write(QJsonDocument(response).toJson(QJsonDocument::Compact));
+}
+
+void LanguageServer::cancel(int id) const {
+    if (auto promise = pending.take(id)) {
+        promise->addResult(QJsonObject{{"error", "cancelled"}});
+        promise->finish();
+        // the server answers with a RequestCancelled error, which is ignored as unknown
+        sendRequest(CancelRequest, {{"id", id}});
+    }
+}
+
+void LanguageServer::failPending() {
+    for (const auto &promise: std::exchange(pending, {})) {
+        promise->addResult(QJsonObject{{"error", "server stopped"}});
+        promise->finish();
+    }
+}
+
+QCoro::Task<bool> LanguageServer::launch(const QString &program, const QStringList &arguments) {
+    if (process != nullptr) {
+        // a previous process which exited or was killed
+        process->disconnect(this);
+        process->deleteLater();
+        failPending();
+        buffer.clear();
+        bufferOffset = 0;
+    }
+    recorder.reset();
+    if (Configs::instance().get("lspRecordTraffic").toBool()) {
+        recorder = std::make_unique<LSPRecorder>(name());
+    }
+    process = new QProcess(this);
+    process->setProcessChannelMode(QProcess::SeparateChannels);
+    connect(process, &QProcess::readyReadStandardOutput, this, &LanguageServer::readMessages);
+    connect(process, &QProcess::readyReadStandardError, this, &LanguageServer::readLog);
+    exitWatch = connect(process, &QProcess::finished, this, &LanguageServer::onProcessFinished);
+    lastActivity.start();
+    co_return co_await qCoro(process).start(program, arguments);
+}
+
+void LanguageServer::onProcessFinished() {
+    qWarning() << "LanguageServer:" << name() << "exited unexpectedly";
+    ready = false;
+    failPending();
+    auto now = QDateTime::currentMSecsSinceEpoch();
+    crashTimes.removeIf([now](qint64 time) { return now - time > CRASH_WINDOW; });
+    crashTimes.append(now);
+    emit crashed();
+}
+
+void LanguageServer::readLog() {
+    logPartial.append(process->readAllStandardError());
+    qsizetype lineStart = 0;
+    for (auto lineEnd = logPartial.indexOf('\n'); lineEnd != -1;
+         lineEnd = logPartial.indexOf('\n', lineStart)) {
+        appendLog(logPartial.sliced(lineStart, lineEnd - lineStart));
+        lineStart = lineEnd + 1;
+    }
+    logPartial.remove(0, lineStart);
+    if (logPartial.size() > LOG_LINE_LIMIT) {
+        appendLog(std::exchange(logPartial, {}));
+    }
+}
+
+void LanguageServer::appendLog(const QByteArray &line) {
+    if (logLines.size() < LOG_CAPACITY) {
+        logLines.append(line);
+    } else {
+        logLines[logHead] = line;
+        logHead = (logHead + 1) % LOG_CAPACITY;
+    }
+}
+
+QString LanguageServer::log() const {
+    QString text;
+    for (qsizetype i = 0; i < logLines.size(); ++i) {
+        text += QString::fromUtf8(logLines[(logHead + i) % logLines.size()]) + '\n';
+    }
+    return text;
+}
+
+void LanguageServer::expire(int id, int interval) const {
+    QTimer::singleShot(interval, this, [this, id] {
+        for (const auto &partial: partialResults) {
+            if (partial.id == id && partial.lastChunk.elapsed() < REQUEST_TIMEOUT) {
+                // still streaming, wait for a pause of the chunks
+                expire(id, REQUEST_TIMEOUT - static_cast<int>(partial.lastChunk.elapsed()));
+                return;
             }
-            co_return response;
         }
+        if (auto timedOut = pending.take(id)) {
+            timedOut->addResult(QJsonObject{{"error", "timeout"}});
+            timedOut->finish();
+        }
+    });
+}
+
+void LanguageServer::recordLatency(qint64 milliseconds) const {
+    averageLatency = averageLatency < 0 ? milliseconds : 0.8 * averageLatency + 0.2 * milliseconds;
+}
+
+LanguageServer::LanguageServer() {
+    decoder = new QObject();
+    decoder->moveToThread(decoderThread());
+    LanguageServerPool::instance().add(this);
+}
+
+QString LanguageServer::root() const { return workspaceRoot; }
+
+bool LanguageServer::isRunning() const {
+    return process != nullptr && process->state() == QProcess::Running;
+}
+
+bool LanguageServer::crashLooping() const {
+    auto now = QDateTime::currentMSecsSinceEpoch();
+    return std::ranges::count_if(crashTimes, [now](qint64 time) {
+               return now - time <= CRASH_WINDOW;
+           }) >= MAX_CRASHES;
+}
+
+qint64 LanguageServer::idleTime() const {
+    return lastActivity.isValid() ? lastActivity.elapsed() : 0;
+}
+
+qint64 LanguageServer::memoryUsage() const {
+    if (!isRunning()) {
+        return -1;
+    }
+    // only there on linux
+    QFile status(QString("/proc/%1/status").arg(process->processId()));
+    if (!status.open(QIODevice::ReadOnly)) {
+        return -1;
+    }
+    for (const auto &line: status.readAll().split('\n')) {
+        if (line.startsWith("VmRSS:")) {
+            return line.sliced(6).trimmed().split(' ').first().toLongLong();
+        }
+    }
+    return -1;
+}
+
+int LanguageServer::latency() const { return qRound(averageLatency); }
+
+const QJsonObject &LanguageServer::capabilities() const { return serverCapabilities; }
+
+LSPSyncKind LanguageServer::documentSync() const { return syncKind; }
+
+QJsonObject LanguageServer::clientCapabilities() {
+    QJsonObject synchronization{{"dynamicRegistration", false}, {"didSave", true}};
+    QJsonObject completion{{"completionItem", QJsonObject{{"snippetSupport", false}}}};
+    QJsonObject semanticTokens{
+            {"requests", QJsonObject{{"full", QJsonObject{{"delta", true}}}}},
+            {"tokenTypes", QJsonArray{"namespace", "type", "class", "enum", "interface",
+                                      "struct", "typeParameter", "parameter", "variable",
+                                      "property", "enumMember", "event", "function", "method",
+                                      "macro", "keyword", "modifier", "comment", "string",
+                                      "number", "regexp", "operator", "decorator"}},
+            {"tokenModifiers", QJsonArray{}},
+            {"formats", QJsonArray{"relative"}},
+            {"multilineTokenSupport", false},
+            {"overlappingTokenSupport", false},
+    };
+    QJsonObject textDocument{
+            {"synchronization", synchronization},
+            {"completion", completion},
+            {"definition", QJsonObject{{"linkSupport", false}}},
+            {"publishDiagnostics", QJsonObject{{"relatedInformation", false}}},
+            {"semanticTokens", semanticTokens},
+            {"references", QJsonObject{{"dynamicRegistration", false}}},
+    };
+    return {
+            {"general", QJsonObject{{"positionEncodings", QJsonArray{"utf-16"}}}},
+            {"textDocument", textDocument},
+            {"workspace", QJsonObject{{"configuration", true},
+                                      {"symbol", QJsonObject{{"dynamicRegistration", false}}}}},
+    };
+}
+
+QCoro::Task<> LanguageServer::waitIdle() {
+    while (busy) {
+        co_await qCoro(this, &LanguageServer::idle);
+    }
+}
+
+QCoro::Task<bool> LanguageServer::open(QString root) {
+    co_await waitIdle();
+    if (ready && workspaceRoot == root && isRunning()) {
+        co_return true;
+    }
+    busy = true;
+    co_await stop();
+    workspaceRoot = root;
+    bool ok = co_await start();
+    if (ok) {
+        auto uri = LSPUri::fromQUrl(root).uri;
+        auto response = co_await initialize(uri, clientCapabilities());
+        ok = response.ok;
+        if (ok) {
+            serverCapabilities = response.capabilities;
+            // either the kind itself or the options with the kind in `change`
+            auto sync = serverCapabilities["textDocumentSync"];
+            auto kind = sync.isObject() ? sync.toObject()["change"].toInt() : sync.toInt();
+            syncKind = kind == 1 ? LSPSyncKind::Full
+                       : kind == 2 ? LSPSyncKind::Incremental
+                                   : LSPSyncKind::None;
+            sendRequest(Initialized, {});
+        }
+    }
+    if (!ok) {
+        qWarning() << "LanguageServer: cannot initialize" << name() << "for" << root;
+    }
+    ready = ok;
+    busy = false;
+    emit idle();
+    if (ok) {
+        emit restarted();
     }
+    co_return ok;
+}
+
+QCoro::Task<bool> LanguageServer::resume() {
+    if (crashLooping()) {
+        co_return false;
+    }
+    co_return co_await open(workspaceRoot);
+}
+
+QCoro::Task<> LanguageServer::stop() {
+    ready = false;
+    if (!isRunning()) {
+        co_return;
+    }
+    disconnect(exitWatch);
+    co_await request<ShutdownResponse>(Shutdown, {}).response;
+    sendRequest(Exit, {});
+    if (!co_await qCoro(process).waitForFinished(EXIT_TIMEOUT)) {
+        process->kill();
+    }
+    // the requests sent meanwhile will not be answered
+    failPending();
+}
+
+QCoro::Task<> LanguageServer::shutdown() {
+    co_await waitIdle();
+    busy = true;
+    co_await stop();
+    busy = false;
+    emit idle();
+}
+
+QCoro::Task<> LanguageServer::restart() {
+    co_await shutdown();
+    co_await resume();
 }
 
 QCoro::Task<InitializeResponse> LanguageServer::initialize(const QString &rootUri,
@@ -175,9 +698,7 @@ QCoro::Task<InitializeResponse> LanguageServer::initialize(const QString &rootUr
             {"rootUri", rootUri},
             {"capabilities", capabilities},
     };
-    sendRequest(Initialize, payload);
-    auto response = co_await waitResponse<InitializeResponse>();
-    co_return response;
+    co_return co_await request<InitializeResponse>(Initialize, payload).response;
 }
 
 QCoro::Task<> LanguageServer::didOpen(const LSPTextDocument &document) const {
@@ -186,71 +707,259 @@ QCoro::Task<> LanguageServer::didOpen(const LSPTextDocument &document) const {
     co_return;
 }
 
-QCoro::Task<CompletionResponse> LanguageServer::completion(const LSPTextDocument &document,
-                                                           const LSPPosition &position) const {
+QCoro::Task<> LanguageServer::didChange(const LSPTextDocument &document,
+                                        const QList<LSPTextChange> &changes) const {
+    if (syncKind == LSPSyncKind::None) {
+        co_return;
+    }
+    QJsonArray contentChanges;
+    auto identifier = document;
+    if (syncKind == LSPSyncKind::Full) {
+        // the caller gives the text along for such a server, a change without range replaces all
+        contentChanges.append(LSPTextChange{std::nullopt, document.text.value_or("")}.toJson());
+        identifier.text.reset();
+    } else {
+        for (const auto &change: changes) {
+            contentChanges.append(change.toJson());
+        }
+    }
+    QJsonObject payload = {identifier.toEntry(), {"contentChanges", contentChanges}};
+    sendRequest(DidChange, payload);
+    co_return;
+}
+
+QCoro::Task<> LanguageServer::didSave(const LSPTextDocument &document) const {
+    QJsonObject payload = {document.toEntry()};
+    sendRequest(DidSave, payload);
+    co_return;
+}
+
+QCoro::Task<> LanguageServer::didClose(const LSPTextDocument &document) const {
+    QJsonObject payload = {document.toEntry()};
+    sendRequest(DidClose, payload);
+    co_return;
+}
+
+LSPRequest<CompletionResponse> LanguageServer::completion(const LSPTextDocument &document,
+                                                          const LSPPosition &position,
+                                                          const QString &prefix) const {
     QJsonObject payload = {document.toEntry(), position.toEntry()};
-    sendRequest(Completion, payload);
-    auto response = co_await waitResponse<CompletionResponse>();
-    co_return response;
+    CompletionResponse response;
+    response.prefix = prefix;
+    return request<CompletionResponse>(Completion, payload, response);
 }
 
 QCoro::Task<DefinitionResponse> LanguageServer::definition(const LSPTextDocument &document,
                                                            const LSPPosition &position) const {
     QJsonObject payload = {document.toEntry(), position.toEntry()};
-    sendRequest(Definition, payload);
-    auto response = co_await waitResponse<DefinitionResponse>();
-    co_return response;
+    co_return co_await request<DefinitionResponse>(Definition, payload).response;
 };
 
+LSPRequest<SemanticTokensResponse>
+LanguageServer::semanticTokens(const LSPTextDocument &document) const {
+    QJsonObject payload = {document.toEntry()};
+    return request<SemanticTokensResponse>(SemanticTokensFull, payload);
+}
+
+LSPRequest<SemanticTokensResponse>
+LanguageServer::semanticTokensDelta(const LSPTextDocument &document,
+                                    const QString &previousResultId) const {
+    QJsonObject payload = {document.toEntry(), {"previousResultId", previousResultId}};
+    return request<SemanticTokensResponse>(SemanticTokensDelta, payload);
+}
+
+LSPRequest<> LanguageServer::references(
+        const LSPTextDocument &document, const LSPPosition &position,
+        std::function<void(const ReferencesResponse &)> chunk) const {
+    QJsonObject payload = {document.toEntry(), position.toEntry(),
+                           {"context", QJsonObject{{"includeDeclaration", true}}}};
+    return streamRequest<ReferencesResponse>(References, payload, std::move(chunk));
+}
+
+LSPRequest<> LanguageServer::workspaceSymbols(
+        const QString &query, std::function<void(const WorkspaceSymbolResponse &)> chunk) const {
+    QJsonObject payload = {{"query", query}};
+    return streamRequest<WorkspaceSymbolResponse>(WorkspaceSymbol, payload, std::move(chunk));
+}
+
+QStringList LanguageServer::semanticTokenTypes() const {
+    auto legend = serverCapabilities["semanticTokensProvider"].toObject()["legend"].toObject();
+    QStringList types;
+    for (const auto &type: legend["tokenTypes"].toArray()) {
+        types.append(type.toString());
+    }
+    return types;
+}
+
+bool LanguageServer::semanticTokensDeltaSupported() const {
+    auto full = serverCapabilities["semanticTokensProvider"].toObject()["full"];
+    return full.isObject() && full.toObject()["delta"].toBool();
+}
+
+QCoro::Task<> LanguageServer::warmUp(const LSPTextDocument &document) const {
+    auto provider = serverCapabilities["documentSymbolProvider"];
+    if (provider.isUndefined() || provider == false) {
+        co_return;
+    }
+    QJsonObject payload = {document.toEntry()};
+    co_await request<DocumentSymbolResponse>(DocumentSymbol, payload).response;
+}
+
 ClangdLanguageServer *ClangdLanguageServer::instance = nullptr;
 
-QCoro::Task<ClangdLanguageServer *> ClangdLanguageServer::getServer() {
+ClangdLanguageServer *ClangdLanguageServer::getServer() {
     if (instance == nullptr) {
         instance = new ClangdLanguageServer();
         qDebug() << "ClangdLanguageServer: Server created";
-        co_await instance->start();
     }
-    co_return instance;
+    return instance;
 }
 
-QCoro::Task<> ClangdLanguageServer::start() {
+QString ClangdLanguageServer::name() const { return "clangd"; }
+
+QCoro::Task<bool> ClangdLanguageServer::start() {
     QString serverName = "clangd";
-    QStringList serverParams = {"--log=verbose"};
-    process = new QProcess(this);
-    process->setProcessChannelMode(QProcess::SeparateChannels);
-    co_await qCoro(process).start(serverName, serverParams);
-    co_return;
+    // clangd names its levels like the config
+    QStringList serverParams = {"--log=" + LanguageServerPool::instance().logLevel()};
+    // a project without a database of its own gets a generated one
+    if (auto directory = CompileDatabase::directory(root()); !directory.isEmpty()) {
+        serverParams.append("--compile-commands-dir=" + directory);
+    }
+    co_return co_await launch(serverName, serverParams);
 }
 
 PylspLanguageServer *PylspLanguageServer::instance = nullptr;
 
-QCoro::Task<PylspLanguageServer *> PylspLanguageServer::getServer() {
+PylspLanguageServer *PylspLanguageServer::getServer() {
     if (instance == nullptr) {
         instance = new PylspLanguageServer();
         qDebug() << "PylspLanguageServer: Server created";
-        co_await instance->start();
     }
-    co_return instance;
+    return instance;
 }
 
-QCoro::Task<> PylspLanguageServer::start() {
+QString PylspLanguageServer::name() const { return "pylsp"; }
+
+QCoro::Task<bool> PylspLanguageServer::start() {
     // TODO: use pyright later?
     QString serverName = "pylsp";
-    QStringList serverParams = {"-vv"};
-    process = new QProcess(this);
-    process->setProcessChannelMode(QProcess::SeparateChannels);
-    co_await qCoro(process).start(serverName, serverParams);
-    co_return;
+    auto level = LanguageServerPool::instance().logLevel();
+    QStringList serverParams;
+    if (level == "info") {
+        serverParams = {"-v"};
+    } else if (level == "verbose") {
+        serverParams = {"-vv"};
+    }
+    co_return co_await launch(serverName, serverParams);
+}
+
+/* Server pool */
+
+LanguageServerPool::LanguageServerPool(QObject *parent) : QObject(parent) {
+    setIdleTimeout(Configs::instance().get("lspIdleTimeout"));
+    Configs::bindHotUpdateOn(this, "lspIdleTimeout", &LanguageServerPool::setIdleTimeout);
+    level = Configs::instance().get("lspLogLevel").toString();
+    Configs::bindHotUpdateOn(this, "lspLogLevel", &LanguageServerPool::setLogLevel);
+    auto *timer = new QTimer(this);
+    connect(timer, &QTimer::timeout, this, &LanguageServerPool::supervise);
+    timer->start(SUPERVISE_INTERVAL);
+}
+
+LanguageServerPool &LanguageServerPool::instance() {
+    static LanguageServerPool instance;
+    return instance;
+}
+
+void LanguageServerPool::setIdleTimeout(const QJsonValue &minutes) {
+    idleTimeout = static_cast<qint64>(minutes.toDouble() * 60000);
+}
+
+void LanguageServerPool::setLogLevel(const QJsonValue &value) {
+    level = value.toString();
+    for (auto *server: servers) {
+        if (server->isRunning()) {
+            server->restart();
+        }
+    }
+}
+
+QString LanguageServerPool::logLevel() const { return level; }
+
+void LanguageServerPool::add(LanguageServer *server) {
+    servers.append(server);
+    connect(server, &LanguageServer::crashed, this, [server] {
+        if (server->crashLooping()) {
+            qWarning() << "LanguageServerPool:" << server->name() << "keeps crashing, given up";
+            return;
+        }
+        QTimer::singleShot(RESTART_DELAY, server, [server] { server->resume(); });
+    });
+    connect(server, &LanguageServer::notificationReceived, this,
+            [](const QString &method, const QJsonObject &params) {
+                if (method == methodMap[PublishDiagnostics]) {
+                    DiagnosticStore::instance().publish(params);
+                }
+            });
+}
+
+const QList<LanguageServer *> &LanguageServerPool::all() const { return servers; }
+
+void LanguageServerPool::supervise() {
+    QStringList stats;
+    for (auto *server: servers) {
+        if (!server->isRunning()) {
+            continue;
+        }
+        if (idleTimeout > 0 && server->idleTime() > idleTimeout) {
+            // the editors resume it on their next request
+            qDebug() << "LanguageServerPool:" << server->name() << "idle, shutting down";
+            server->shutdown();
+            continue;
+        }
+        auto stat = server->name();
+        if (auto memory = server->memoryUsage(); memory >= 0) {
+            stat += QString(" %1 MB").arg(memory / 1024);
+        }
+        if (auto latency = server->latency(); latency >= 0) {
+            stat += QString(" %1 ms").arg(latency);
+        }
+        stats.append(stat);
+    }
+    emit statsChanged(stats.join("  "));
 }
 
-QCoro::Task<LanguageServer *> LanguageServers::get(Language language) {
+QString LanguageServers::workspace;
+
+QCoro::Task<LanguageServer *> LanguageServers::get(Language language, QString fallbackRoot) {
+    LanguageServer *server;
     switch (language) {
         case Language::C:
         case Language::CPP:
-            co_return co_await ClangdLanguageServer::getServer();
+            server = ClangdLanguageServer::getServer();
+            break;
         case Language::PYTHON:
-            co_return co_await PylspLanguageServer::getServer();
+            server = PylspLanguageServer::getServer();
+            break;
         default:
             co_return nullptr;
     }
+    if (server->crashLooping()) {
+        co_return nullptr; // the pool gave up on it, a new tab should not restart it
+    }
+    auto root = workspace;
+    if (root.isEmpty()) {
+        // without a project, keep the root the server already has
+        root = server->root().isEmpty() ? fallbackRoot : server->root();
+    }
+    co_return co_await server->open(root) ? server : nullptr;
+}
+
+void LanguageServers::setWorkspace(const QString &root) {
+    workspace = root;
+    for (auto *server: LanguageServerPool::instance().all()) {
+        if (server->isRunning() && server->root() != root) {
+            // the next get() waits for the shutdown and initializes again
+            server->shutdown();
+        }
+    }
 }
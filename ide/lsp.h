@@ -1,20 +1,31 @@
 #ifndef LSP_H
 #define LSP_H
 
+#include <QElapsedTimer>
+#include <QHash>
 #include <QJsonObject>
 #include <QMutex>
 #include <QProcess>
 #include <QPromise>
+#include <functional>
+#include <memory>
 #include <qcorotask.h>
 
 #include "language.h"
+#include "lspRecorder.h"
 
 /* Basic request and response */
 
 enum LSPRequestMethod {
     Initialize,
+    Initialized,
     Shutdown,
+    Exit,
+    CancelRequest,
     DidOpen,
+    DidChange,
+    DidSave,
+    DidClose,
     Completion,
     Definition,
     Hover,
@@ -22,14 +33,21 @@ enum LSPRequestMethod {
     Formatting,
     Rename,
     PublishDiagnostics,
-    DocumentSymbol
+    DocumentSymbol,
+    SemanticTokensFull,
+    SemanticTokensDelta,
+    WorkspaceSymbol
 };
 
 struct LSPUri {
     QString uri;
 
     static LSPUri fromQUrl(const QUrl &url);
+    /** Encodes what a URL would take for a fragment or a query, e.g. '#' or '?' */
+    static LSPUri fromLocalFile(const QString &path);
     QUrl toQUrl() const;
+    /** The decoded path of a file URI */
+    QString toLocalFile() const;
 };
 
 struct LSPTextDocument {
@@ -49,6 +67,8 @@ struct LSPPosition {
     void readJson(QJsonObject json);
     QJsonObject toJson() const;
     std::pair<QString, QJsonValue> toEntry() const;
+    /** The position at the end of the text, which starts here. Counts UTF-16 units like QString */
+    LSPPosition after(QStringView text) const;
 };
 
 struct LSPRange {
@@ -56,6 +76,25 @@ struct LSPRange {
     LSPPosition end;
 
     void readJson(QJsonObject json);
+    QJsonObject toJson() const;
+};
+
+/** How a server wants the changes of a document, the values are those of the protocol */
+enum class LSPSyncKind { None = 0, Full = 1, Incremental = 2 };
+
+struct LSPTextChange {
+    /** Without a range, the text replaces the whole document */
+    std::optional<LSPRange> range;
+    QString text;
+
+    QJsonObject toJson() const;
+};
+
+/** A request on its way: its id cancels it, and the task finishes with the response */
+template<typename R = void>
+struct LSPRequest {
+    int id = 0;
+    QCoro::Task<R> response;
 };
 
 struct LSPResponse {
@@ -67,6 +106,7 @@ struct LSPResponse {
 
 struct InitializeResponse : LSPResponse {
     bool ok = false;
+    QJsonObject capabilities;
     void parseJson(const QJsonObject &response) override;
 };
 
@@ -74,6 +114,36 @@ struct ShutdownResponse : LSPResponse {
     void parseJson(const QJsonObject &response) override;
 };
 
+/** Only the number of symbols, the request is sent to make the server parse the document */
+struct DocumentSymbolResponse : LSPResponse {
+    qsizetype count = 0;
+    void parseJson(const QJsonObject &response) override;
+};
+
+struct SemanticTokensEdit {
+    int start;
+    int deleteCount;
+    QList<uint32_t> data;
+};
+
+/** Tokens as the packed integers of the protocol, five for each token */
+struct SemanticTokensResponse : LSPResponse {
+    bool ok = false;
+    QString resultId;
+    /** A full response has the data, a delta one the edits of the previous data */
+    bool full = false;
+    QList<uint32_t> data;
+    QList<SemanticTokensEdit> edits;
+    void parseJson(const QJsonObject &response) override;
+    /** Apply the edits of a delta response to the previous data */
+    void applyTo(QList<uint32_t> &previous) const;
+    /**
+     * The tokens [first, last) that the edits put into the new data, in order.
+     * Null if an edit does not cover whole tokens.
+     */
+    std::optional<QList<QPair<qsizetype, qsizetype>>> changedTokens() const;
+};
+
 struct CompletionItem {
     enum ItemKind {
         Text = 1,
@@ -110,7 +180,9 @@ struct CompletionItem {
 };
 
 struct CompletionResponse : LSPResponse {
-    bool incomplete;
+    bool incomplete = true;
+    /** Only the items starting with it are kept, as the others would never be shown */
+    QString prefix;
     QList<CompletionItem> items;
     void parseJson(const QJsonObject &response) override;
 };
@@ -125,37 +197,227 @@ struct DefinitionResponse : LSPResponse {
     void parseJson(const QJsonObject &response) override;
 };
 
+/** References are locations as well */
+using ReferencesResponse = DefinitionResponse;
+
+struct SymbolItem {
+    QString name;
+    /** The SymbolKind of the protocol */
+    int kind;
+    QString container;
+    DefinitionItem location;
+};
+
+struct WorkspaceSymbolResponse : LSPResponse {
+    QList<SymbolItem> items;
+    void parseJson(const QJsonObject &response) override;
+};
+
 class LanguageServer : public QObject {
     Q_OBJECT
 
+signals:
+    /** The server is no longer starting or shutting down */
+    void idle();
+    /** The process exited without being asked to */
+    void crashed();
+    /** A new process has been initialized, the open documents have to be opened again */
+    void restarted();
+    /** A notification from the server, e.g. textDocument/publishDiagnostics */
+    void notificationReceived(const QString &method, const QJsonObject &params);
+
+private:
+    /** Requests without a response in this time fail */
+    static constexpr int REQUEST_TIMEOUT = 10000;
+
+    mutable int nextId = 0;
+    mutable int nextToken = 0;
+    struct PartialResult {
+        /** The request the chunks belong to */
+        int id;
+        /** Restarted by every chunk, the request only times out once the chunks pause */
+        QElapsedTimer lastChunk;
+        /** Convert a chunk in the decoder thread and hand it to the GUI thread */
+        std::function<void(const QJsonValue &)> receive;
+    };
+    /** Receive the `$/progress` chunks of a partial result token */
+    mutable QHash<QString, PartialResult> partialResults;
+    /** The requests waiting for their response, by id */
+    mutable QHash<int, std::shared_ptr<QPromise<QJsonObject>>> pending;
+    /** Bytes read from stdout, the messages before `bufferOffset` are handled */
+    QByteArray buffer;
+    qsizetype bufferOffset = 0;
+    /** The traffic of the current process, null unless `lspRecordTraffic` is on */
+    std::unique_ptr<LSPRecorder> recorder;
+    /** Lives in the decoder thread, the JSON of the messages is read there */
+    QObject *decoder;
+    /** The thread shared by the decoders of all servers */
+    static QThread *decoderThread();
+
+    /** Starting, initializing or shutting down, the others wait for it */
+    bool busy = false;
+    /** Initialized for `workspaceRoot`, with the capabilities it answered */
+    bool ready = false;
+    QString workspaceRoot;
+    QJsonObject serverCapabilities;
+    /** Read from the capabilities once, didChange is sent for every pause of the typing */
+    LSPSyncKind syncKind = LSPSyncKind::None;
+
+    /** Tells a crash from an exit after shutdown, which disconnects it first */
+    QMetaObject::Connection exitWatch;
+    /** Restarted on every message to or from the server */
+    mutable QElapsedTimer lastActivity;
+    /** Moving average of the response time in milliseconds, -1 before any response */
+    mutable double averageLatency = -1;
+    /** When the recent crashes happened, in milliseconds since epoch */
+    QList<qint64> crashTimes;
+    static constexpr int MAX_CRASHES = 3;
+    static constexpr int CRASH_WINDOW = 60000;
+
+    /** The last lines of stderr, a ring starting at `logHead` once it is full */
+    QList<QByteArray> logLines;
+    qsizetype logHead = 0;
+    /** The end of stderr not terminated by a newline yet */
+    QByteArray logPartial;
+    static constexpr qsizetype LOG_CAPACITY = 2000;
+    static constexpr qsizetype LOG_LINE_LIMIT = 4096;
+
+    /** Read the complete messages on stdout and dispatch them */
+    void readMessages();
+    void dispatch(const QJsonObject &message);
+    /** Frame the content and write it to the process stdin, dropped if the process is gone */
+    void write(const QByteArray &content) const;
+    /** Answer a request from the server */
+    void sendResponse(const QJsonValue &id, const QJsonValue &result) const;
+    /** Fail the requests in flight, their answers will never come */
+    void failPending();
+    QCoro::Task<> waitIdle();
+    /** Send shutdown and exit, kill the process if it does not exit in time */
+    QCoro::Task<> stop();
+    void onProcessFinished();
+    /** Drain stderr into the ring, so the server never blocks on a full pipe */
+    void readLog();
+    void appendLog(const QByteArray &line);
+    void recordLatency(qint64 milliseconds) const;
+    /** Fail the request if it has no response after the interval */
+    void expire(int id, int interval) const;
+    /**
+     * Wait for the JSON of a request and read it into the response in the decoder thread
+     * @param timer started when the request was sent, invalid if its latency does not count
+     */
+    template<std::derived_from<LSPResponse> R>
+    QCoro::Task<R> receive(std::shared_ptr<QPromise<QJsonObject>> promise, QElapsedTimer timer,
+                           R response) const;
+    /** Wait for the final response of a streamed request, the chunks came before it */
+    template<std::derived_from<LSPResponse> R>
+    QCoro::Task<> finishStream(QString token, QCoro::Task<R> task,
+                               std::function<void(const R &)> chunk) const;
+
 protected:
+    /** Time given to the server to exit after the shutdown request */
+    static constexpr int EXIT_TIMEOUT = 2000;
+
     mutable QMutex mutex;
     QProcess *process = nullptr;
+    /** Start the server process and begin reading its messages */
+    QCoro::Task<bool> launch(const QString &program, const QStringList &arguments);
     /**
      * @brief send a request to the server
      * @param method the method to call
      * @param payload the payload to send
+     * @return the id of the request, 0 for a notification
      */
-    void sendRequest(LSPRequestMethod method, const QJsonObject &payload) const;
+    int sendRequest(LSPRequestMethod method, const QJsonObject &payload) const;
+    /**
+     * @brief send a request, its task waits for its own response while others are in flight
+     * @tparam R the type of the response, read from the JSON in the decoder thread
+     * @param response what the response starts with, e.g. the prefix of a completion
+     * @return the id of the request and the task of the response
+     */
+    template<std::derived_from<LSPResponse> R>
+    LSPRequest<R> request(LSPRequestMethod method, const QJsonObject &payload,
+                          R response = {}) const;
     /**
-     * @brief wait for a response from the server
-     * @tparam R the type of the response
-     * @return the response
+     * @brief send a request with a partial result token, the server may send the results in chunks
+     * @param chunk called with every chunk, and last with the final response
      */
     template<std::derived_from<LSPResponse> R>
-    QCoro::Task<R> waitResponse() const;
+    LSPRequest<> streamRequest(LSPRequestMethod method, QJsonObject payload,
+                               std::function<void(const R &)> chunk) const;
 
 public:
-    virtual QCoro::Task<> start() = 0;
+    LanguageServer();
+    virtual QString name() const = 0;
+    virtual QCoro::Task<bool> start() = 0;
+    /**
+     * @brief start the server if needed and initialize it for the root, once per root
+     * @return whether the server is ready for requests about the root
+     */
+    QCoro::Task<bool> open(QString root);
+    /** Open again for the last root, after a crash or an idle shutdown */
+    QCoro::Task<bool> resume();
+    /** Shut the server down, the next open() starts it again */
+    QCoro::Task<> shutdown();
+    /** Start a new process for the same root, e.g. with another log level */
+    QCoro::Task<> restart();
+    /** Give up on a request, its task finishes with an empty response */
+    void cancel(int id) const;
+    /** The workspace root the server was last opened for */
+    QString root() const;
+    bool isRunning() const;
+    /** Crashed too often recently, so it is not restarted any more */
+    bool crashLooping() const;
+    /** Milliseconds since the last message to or from the server */
+    qint64 idleTime() const;
+    /** Resident memory of the process in KB, -1 if unknown */
+    qint64 memoryUsage() const;
+    /** Average time of the answered requests in milliseconds, -1 before any answer */
+    int latency() const;
+    /** The last lines the server wrote to stderr */
+    QString log() const;
+    /** The capabilities the server answered to initialize */
+    const QJsonObject &capabilities() const;
+    /** How the server wants the changes of the documents */
+    LSPSyncKind documentSync() const;
+    /** What the editor supports, advertised to every server */
+    static QJsonObject clientCapabilities();
     static QString commentPrefix(Language language);
 
     QCoro::Task<InitializeResponse> initialize(const QString &rootUri,
                                                const QJsonObject &capabilities) const;
-    QCoro::Task<CompletionResponse> completion(const LSPTextDocument &document,
-                                               const LSPPosition &position) const;
+    LSPRequest<CompletionResponse> completion(const LSPTextDocument &document,
+                                              const LSPPosition &position,
+                                              const QString &prefix = {}) const;
     QCoro::Task<> didOpen(const LSPTextDocument &document) const;
+    /**
+     * Send the changes, or the text of the document to a server that only takes the full text.
+     * Nothing is sent to a server that does not sync documents.
+     */
+    QCoro::Task<> didChange(const LSPTextDocument &document,
+                            const QList<LSPTextChange> &changes) const;
+    QCoro::Task<> didSave(const LSPTextDocument &document) const;
+    QCoro::Task<> didClose(const LSPTextDocument &document) const;
     QCoro::Task<DefinitionResponse> definition(const LSPTextDocument &document,
                                                const LSPPosition &position) const;
+    LSPRequest<SemanticTokensResponse> semanticTokens(const LSPTextDocument &document) const;
+    /** The changes of the tokens since the response with the result id */
+    LSPRequest<SemanticTokensResponse> semanticTokensDelta(const LSPTextDocument &document,
+                                                           const QString &previousResultId) const;
+    /** Find the uses of the symbol at the position, the results come in chunks */
+    LSPRequest<> references(const LSPTextDocument &document, const LSPPosition &position,
+                            std::function<void(const ReferencesResponse &)> chunk) const;
+    /** Search the symbols of the workspace, the results come in chunks */
+    LSPRequest<> workspaceSymbols(const QString &query,
+                                  std::function<void(const WorkspaceSymbolResponse &)> chunk) const;
+    /** The token types the indices in the semantic tokens refer to */
+    QStringList semanticTokenTypes() const;
+    /** Whether the server sends deltas of the semantic tokens */
+    bool semanticTokensDeltaSupported() const;
+    /**
+     * Ask for the symbols of a document just opened. The server has to parse it for them, e.g.
+     * clangd builds the preamble, which the first completion would otherwise wait for.
+     */
+    QCoro::Task<> warmUp(const LSPTextDocument &document) const;
     // TODO: support more functions in LSP
 };
 
@@ -163,21 +425,68 @@ class ClangdLanguageServer : public LanguageServer {
     static ClangdLanguageServer *instance;
 
 public:
-    static QCoro::Task<ClangdLanguageServer *> getServer();
-    QCoro::Task<> start() override;
+    static ClangdLanguageServer *getServer();
+    QString name() const override;
+    QCoro::Task<bool> start() override;
 };
 
 class PylspLanguageServer : public LanguageServer {
     static PylspLanguageServer *instance;
 
 public:
-    static QCoro::Task<PylspLanguageServer *> getServer();
-    QCoro::Task<> start() override;
+    static PylspLanguageServer *getServer();
+    QString name() const override;
+    QCoro::Task<bool> start() override;
+};
+
+/**
+ * Supervises every server: restarts the crashed ones, shuts down the ones idle for too long
+ * and samples their memory and latency.
+ */
+class LanguageServerPool : public QObject {
+    Q_OBJECT
+
+    static constexpr int SUPERVISE_INTERVAL = 5000;
+    static constexpr int RESTART_DELAY = 1000;
+
+    QList<LanguageServer *> servers;
+    /** Shut down a server without messages for this long, in milliseconds, 0 to never */
+    qint64 idleTimeout = 0;
+    /** One of error, info and verbose */
+    QString level;
+
+    explicit LanguageServerPool(QObject *parent = nullptr);
+    void supervise();
+
+private slots:
+    void setIdleTimeout(const QJsonValue &minutes);
+    /** Restart the running servers, the log level is a command line argument */
+    void setLogLevel(const QJsonValue &value);
+
+signals:
+    /** Memory and latency of the running servers, as a line for the footer */
+    void statsChanged(const QString &stats);
+
+public:
+    static LanguageServerPool &instance();
+    void add(LanguageServer *server);
+    const QList<LanguageServer *> &all() const;
+    QString logLevel() const;
 };
 
 class LanguageServers {
+    /** The root of the opened project, empty if only single files are open */
+    static QString workspace;
+
 public:
-    static QCoro::Task<LanguageServer *> get(Language language);
+    /**
+     * @brief the server of the language, initialized for the workspace
+     * @param fallbackRoot the root to use when no project is open
+     * @return null if there is no server for the language or it cannot be initialized
+     */
+    static QCoro::Task<LanguageServer *> get(Language language, QString fallbackRoot = {});
+    /** Switch to another project, the servers of the previous one are shut down */
+    static void setWorkspace(const QString &root);
 };
 
 
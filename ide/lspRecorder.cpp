@@ -0,0 +1,56 @@
+#include "lspRecorder.h"
+
+#include <QDateTime>
+#include <QDir>
+#include <QStandardPaths>
+
+LSPRecorder::LSPRecorder(const QString &serverName) {
+    auto directory = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) +
+                     "/never-judge/lsp-traffic";
+    QDir().mkpath(directory);
+    auto time = QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss-zzz");
+    file.setFileName(QString("%1/%2-%3.lsplog").arg(directory, serverName, time));
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "LSPRecorder: cannot write" << file.fileName();
+    }
+    clock.start();
+}
+
+bool LSPRecorder::isOpen() const { return file.isOpen(); }
+
+void LSPRecorder::record(Direction direction, QByteArray content) {
+    if (!file.isOpen()) {
+        return;
+    }
+    // a newline in JSON can only be whitespace, inside a string it is escaped
+    content.replace('\n', ' ').replace('\r', ' ');
+    auto marker = direction == Sent ? '>' : '<';
+    auto time = QByteArray::number(clock.nsecsElapsed() / 1000);
+    file.write(time + ' ' + marker + ' ' + content + '\n');
+    // keep the log complete even if the IDE crashes
+    file.flush();
+}
+
+QList<LSPRecorder::Entry> LSPRecorder::read(const QString &path) {
+    QFile log(path);
+    if (!log.open(QIODevice::ReadOnly)) {
+        qWarning() << "LSPRecorder: cannot read" << path;
+        return {};
+    }
+    QList<Entry> entries;
+    while (!log.atEnd()) {
+        auto line = log.readLine().trimmed();
+        auto timeEnd = line.indexOf(' ');
+        if (timeEnd < 0 || line.size() < timeEnd + 3) {
+            continue;
+        }
+        bool ok;
+        auto time = line.left(timeEnd).toLongLong(&ok);
+        auto marker = line[timeEnd + 1];
+        if (!ok || (marker != '>' && marker != '<')) {
+            continue;
+        }
+        entries.append({time, marker == '>' ? Sent : Received, line.mid(timeEnd + 3)});
+    }
+    return entries;
+}
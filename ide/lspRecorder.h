@@ -0,0 +1,33 @@
+#ifndef LSP_RECORDER_H
+#define LSP_RECORDER_H
+
+#include <QElapsedTimer>
+#include <QFile>
+
+/**
+ * Writes every framed message of a server process to a log, one line per message: the
+ * microseconds since the process started, `>` for sent or `<` for received, and the JSON.
+ * The logs can be replayed by the fake server of the benchmarks.
+ */
+class LSPRecorder {
+    QFile file;
+    QElapsedTimer clock;
+
+public:
+    enum Direction { Sent, Received };
+
+    struct Entry {
+        qint64 time;
+        Direction direction;
+        QByteArray content;
+    };
+
+    /** Start a new log of the server in the cache directory */
+    explicit LSPRecorder(const QString &serverName);
+    bool isOpen() const;
+    void record(Direction direction, QByteArray content);
+    /** Read a log back, the lines that cannot be read are skipped */
+    static QList<Entry> read(const QString &path);
+};
+
+#endif // LSP_RECORDER_H
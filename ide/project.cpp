@@ -1,5 +1,6 @@
 #include "project.h"
 
+#include <QDirIterator>
 #include <utility>
 
 Project::Project() = default;
@@ -7,3 +8,27 @@ Project::Project() = default;
 Project::Project(QString root) : root(std::move(root)) {}
 
 QString Project::getRoot() const { return root; }
+
+QSet<Language> Project::scanLanguages() const {
+    static const QSet<Language> known = {Language::C, Language::CPP, Language::PYTHON};
+    QSet<Language> languages;
+    walk(root, {}, [&languages](const QString &path) {
+        auto language = LangFileInfo(path).language();
+        if (known.contains(language)) {
+            languages.insert(language);
+        }
+        return languages != known;
+    });
+    return languages;
+}
+
+void Project::walk(const QString &root, const QStringList &nameFilters,
+                   const std::function<bool(const QString &)> &visit) {
+    // hidden directories like .git are skipped by the default filters
+    QDirIterator it(root, nameFilters, QDir::Files, QDirIterator::Subdirectories);
+    for (int count = 0; it.hasNext() && count < SCAN_LIMIT; ++count) {
+        if (!visit(it.next())) {
+            return;
+        }
+    }
+}
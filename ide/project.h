@@ -1,16 +1,31 @@
 #ifndef PROJECT_H
 #define PROJECT_H
 #include <QFileInfo>
+#include <QSet>
+#include <functional>
+
+#include "language.h"
 
 class Project {
     QString root;
 
 public:
+    /** A scan of the project looks at no more files than this, a folder may be huge */
+    static constexpr int SCAN_LIMIT = 5000;
+
     Project();
 
     explicit Project(QString root);
 
     QString getRoot() const;
+    /** The languages of the files in the project, looking at a bounded number of files */
+    QSet<Language> scanLanguages() const;
+    /**
+     * Visit the files of the tree matching the filters, all without filters, until `visit`
+     * returns false or SCAN_LIMIT files have been visited. Hidden directories are skipped.
+     */
+    static void walk(const QString &root, const QStringList &nameFilters,
+                     const std::function<bool(const QString &)> &visit);
 };
 
 #endif // PROJECT_H
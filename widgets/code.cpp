@@ -3,6 +3,8 @@
 #include <QPainter>
 #include <QVBoxLayout>
 
+#include "../ide/compileDatabase.h"
+#include "../ide/diagnostics.h"
 #include "../ide/highlighter.h"
 #include "../ide/lsp.h"
 #include "../util/file.h"
@@ -62,7 +64,6 @@ void CompletionList::keyPressEvent(QKeyEvent *e) {
 }
 
 void CompletionList::readCompletions(const CompletionResponse &response) {
-    codeEdit->requireCompletion = response.incomplete;
     completions = response.items;
 }
 
@@ -228,9 +229,24 @@ void WelcomeWidget::setup() {
 /* Code plain text edit widget */
 
 CodeEditWidget::CodeEditWidget(const QString &filename, QWidget *parent) :
-    QPlainTextEdit(parent), server(nullptr), modified(false), requireCompletion(true) {
+    QPlainTextEdit(parent), server(nullptr), modified(false) {
     lna = new LineNumberArea(this);
     cl = new CompletionList(this);
+    syncTimer = new QTimer(this);
+    syncTimer->setSingleShot(true);
+    syncTimer->setInterval(200);
+    completionTimer = new QTimer(this);
+    completionTimer->setSingleShot(true);
+    completionTimer->setInterval(80);
+    prefetchTimer = new QTimer(this);
+    prefetchTimer->setSingleShot(true);
+    prefetchTimer->setInterval(600);
+    semanticTimer = new QTimer(this);
+    semanticTimer->setSingleShot(true);
+    semanticTimer->setInterval(500);
+    diagnosticTimer = new QTimer(this);
+    diagnosticTimer->setSingleShot(true);
+    diagnosticTimer->setInterval(16);
     file = LangFileInfo(filename);
     highlighter = HighlighterFactory::getHighlighter(file.language(), document());
 
@@ -241,8 +257,25 @@ CodeEditWidget::CodeEditWidget(const QString &filename, QWidget *parent) :
     connect(this, &CodeEditWidget::setupFinished, this, &CodeEditWidget::onSetupFinished);
     connect(this, &CodeEditWidget::blockCountChanged, this, &CodeEditWidget::adaptViewport);
     connect(this, &CodeEditWidget::updateRequest, this, &CodeEditWidget::updateLineNumberArea);
+    connect(this, &CodeEditWidget::updateRequest, this, &CodeEditWidget::updateVisibleRange);
+    connect(this, &CodeEditWidget::updateRequest, this, &CodeEditWidget::onViewportScrolled);
+    connect(diagnosticTimer, &QTimer::timeout, this, &CodeEditWidget::paintDiagnostics);
+    connect(&DiagnosticStore::instance(), &DiagnosticStore::diagnosticsChanged, this,
+            &CodeEditWidget::onDiagnosticsChanged);
+    connect(&HighlightRegistry::instance(), &HighlightRegistry::semanticRulesChanged, this,
+            &CodeEditWidget::updateSemanticFormats);
     connect(this, &CodeEditWidget::cursorPositionChanged, this, &CodeEditWidget::highlightLine);
+    if (highlighter) {
+        connect(highlighter, &Highlighter::bracketsChanged, this, &CodeEditWidget::highlightLine);
+    }
     connect(this, &QPlainTextEdit::textChanged, this, &CodeEditWidget::onTextChanged);
+    connect(document(), &QTextDocument::contentsChange, this, &CodeEditWidget::recordChange);
+    connect(syncTimer, &QTimer::timeout, this, &CodeEditWidget::syncDocument);
+    connect(completionTimer, &QTimer::timeout, this, &CodeEditWidget::askForCompletion);
+    connect(prefetchTimer, &QTimer::timeout, this, &CodeEditWidget::prefetchCompletion);
+    connect(semanticTimer, &QTimer::timeout, this, &CodeEditWidget::updateSemanticTokens);
+    connect(this, &CodeEditWidget::cursorPositionChanged, prefetchTimer,
+            qOverload<>(&QTimer::start));
     connect(cl, &CompletionList::completionSelected, this, &CodeEditWidget::insertCompletion);
     connect(this, &CodeEditWidget::toggleComment, this, &CodeEditWidget::onToggleComment);
     connect(this, &CodeEditWidget::jumpToDefinition, this, &CodeEditWidget::askForDefinition);
@@ -254,18 +287,230 @@ QCoro::Task<> CodeEditWidget::onSetupFinished() {
     if (highlighter) {
         highlighter->parseDocument();
     }
-    server = co_await LanguageServers::get(file.language());
-    if (server == nullptr) {
-        co_return;
+    if (file.language() == Language::C || file.language() == Language::CPP) {
+        CompileDatabase::instance().addFile(file);
     }
-    auto response = co_await server->initialize(file.path(), {});
-    if (!response.ok) {
-        qWarning() << "Server of language" << langName(file.language()) << "initialized failed";
+    // initialized once per workspace, files opened without a project use their folder
+    QPointer self(this);
+    auto *found = co_await LanguageServers::get(file.language(), file.path());
+    if (!self || found == nullptr) {
+        co_return; // the tab may have been closed while the server started
     }
-    co_await server->didOpen({LSPUri::fromQUrl(file.filePath()), file.language(), toPlainText()});
+    server = found;
+    connect(server, &LanguageServer::restarted, this, &CodeEditWidget::reopenDocument);
+    syncedText = toPlainText();
+    version = 1;
+    co_await server->didOpen({LSPUri::fromLocalFile(file.filePath()), file.language(), syncedText});
+    opened = true;
+    // the parse for it is done while the problem is read, not on the first keystroke
+    server->warmUp(lspDocument());
+    prefetchTimer->start();
+    updateSemanticFormats();
+    updateSemanticTokens();
     co_return;
 }
 
+LSPTextDocument CodeEditWidget::lspDocument() const {
+    return {LSPUri::fromLocalFile(file.filePath()), file.language(), std::nullopt, version};
+}
+
+void CodeEditWidget::recordChange(int position, int charsRemoved, int charsAdded) {
+    if (!opened) {
+        return;
+    }
+    if (!Highlighter::normalizeChange(static_cast<int>(syncedText.size()),
+                                      document()->characterCount() - 1, position, charsRemoved,
+                                      charsAdded)) {
+        // lost track of the text, send all of it
+        syncedText = toPlainText();
+        pendingChanges = {{std::nullopt, syncedText}};
+    } else {
+        QTextCursor cursor(document());
+        cursor.setPosition(position);
+        cursor.setPosition(position + charsAdded, QTextCursor::KeepAnchor);
+        auto text = Highlighter::plainText(cursor.selectedText());
+        if (charsRemoved == charsAdded &&
+            QStringView(syncedText).sliced(position, charsRemoved) == text) {
+            return; // only the format changed, e.g. by a rehighlight
+        }
+        // the lines before the change are the same in both texts, the block knows its number
+        auto block = document()->findBlock(position);
+        LSPPosition start{block.blockNumber(), position - block.position()};
+        LSPRange range{start, start.after(QStringView(syncedText).sliced(position, charsRemoved))};
+        // only the removed characters are read, the copy is kept for them
+        syncedText.replace(position, charsRemoved, text);
+        pendingChanges.append({range, text});
+    }
+    if (position < completionSession.wordStart) {
+        completionSession = {}; // the word moved, and its context changed
+    }
+    syncTimer->start();
+    semanticTimer->start();
+}
+
+QCoro::Task<> CodeEditWidget::syncDocument() {
+    syncTimer->stop();
+    if (!server || !opened) {
+        co_return;
+    }
+    // a server shut down when idle, or crashed, starts again and reopens the document
+    QPointer self(this);
+    bool running = co_await server->resume();
+    if (!self || !running || pendingChanges.isEmpty()) {
+        co_return;
+    }
+    auto changes = std::exchange(pendingChanges, {});
+    ++version;
+    auto textDocument = lspDocument();
+    if (server->documentSync() == LSPSyncKind::Full) {
+        textDocument.text = syncedText; // the server takes no ranges
+    }
+    co_await server->didChange(textDocument, changes);
+}
+
+void CodeEditWidget::reopenDocument() {
+    if (!opened) {
+        return; // not opened yet, it is opened with the new process anyway
+    }
+    pendingChanges.clear();
+    syncedText = toPlainText();
+    version = 1;
+    server->didOpen({LSPUri::fromLocalFile(file.filePath()), file.language(), syncedText});
+    server->warmUp(lspDocument());
+    // the new process knows nothing of the previous results
+    semanticResultId.clear();
+    semanticRequest = 0;
+    updateSemanticFormats();
+    updateSemanticTokens();
+}
+
+void CodeEditWidget::updateSemanticFormats() {
+    if (server && highlighter) {
+        auto types = server->semanticTokenTypes();
+        highlighter->setSemanticFormats(HighlightRegistry::instance().semanticFormats(types));
+    }
+}
+
+QCoro::Task<> CodeEditWidget::updateSemanticTokens() {
+    semanticTimer->stop();
+    if (!server || !opened || !highlighter || server->semanticTokenTypes().isEmpty()) {
+        co_return;
+    }
+    // the tokens refer to the text the server knows
+    QPointer self(this);
+    co_await syncDocument();
+    if (!self || !opened) {
+        co_return;
+    }
+    if (semanticRequest != 0) {
+        server->cancel(std::exchange(semanticRequest, 0));
+    }
+    int requestVersion = version;
+    bool delta = !semanticResultId.isEmpty() && server->semanticTokensDeltaSupported();
+    auto request = delta ? server->semanticTokensDelta(lspDocument(), semanticResultId)
+                         : server->semanticTokens(lspDocument());
+    semanticRequest = request.id;
+    auto response = co_await std::move(request.response);
+    if (!self || semanticRequest != request.id) {
+        co_return; // cancelled by a newer request, or by closing the document
+    }
+    semanticRequest = 0;
+    if (!response.ok || version != requestVersion || !pendingChanges.isEmpty()) {
+        co_return; // about an older text, the next sync asks again
+    }
+    semanticResultId = response.resultId;
+    auto changed = response.changedTokens();
+    if (response.full) {
+        semanticData = std::move(response.data);
+    } else {
+        response.applyTo(semanticData);
+    }
+    if (response.full || !changed || highlighter->semanticTokensDropped()) {
+        paintSemanticTokens(0, semanticData.size() / 5);
+        co_return;
+    }
+    // the tokens around the edits are the same, and the spans already follow the text
+    for (auto [first, last]: *changed) {
+        paintSemanticTokens(first, last);
+    }
+}
+
+/** Move a token position over the tokens [first, last) of the packed data */
+static LSPPosition advanceTokens(const QList<uint32_t> &data, LSPPosition position,
+                                 qsizetype first, qsizetype last) {
+    for (auto i = first * 5; i < last * 5 && i + 4 < data.size(); i += 5) {
+        if (data[i] > 0) {
+            position.line += static_cast<int>(data[i]);
+            position.character = static_cast<int>(data[i + 1]);
+        } else {
+            position.character += static_cast<int>(data[i + 1]);
+        }
+    }
+    return position;
+}
+
+void CodeEditWidget::paintSemanticTokens(qsizetype first, qsizetype last) {
+    // only sums integers up to the first token, the blocks are only visited for [first, last)
+    auto anchor = advanceTokens(semanticData, {0, 0}, 0, first);
+    auto tokens = decodeSemanticTokens(first, last, anchor);
+    auto offset = [this](LSPPosition position) -> qint64 {
+        auto block = document()->findBlockByNumber(position.line);
+        if (!block.isValid()) {
+            return document()->characterCount();
+        }
+        return block.position() + qMin(position.character, block.length() - 1);
+    };
+    // the spans strictly between the neighbours of the tokens are replaced
+    qint64 from = first == 0 ? 0 : offset(anchor) + 1;
+    qint64 to = UINT32_MAX;
+    if (last < semanticData.size() / 5) {
+        to = offset(advanceTokens(semanticData, anchor, first, last + 1));
+    }
+    highlighter->setSemanticTokens(tokens, static_cast<uint32_t>(from), static_cast<uint32_t>(to));
+}
+
+SpanTable CodeEditWidget::decodeSemanticTokens(qsizetype first, qsizetype last,
+                                               LSPPosition anchor) const {
+    SpanTable tokens;
+    auto block = document()->findBlockByNumber(anchor.line);
+    auto character = static_cast<uint32_t>(anchor.character);
+    last = qMin(last, semanticData.size() / 5);
+    // each token is relative to the previous one: line delta, start delta, length, type, modifiers
+    for (auto i = first * 5; i < last * 5 && block.isValid(); i += 5) {
+        if (auto lines = semanticData[i]; lines > 0) {
+            for (uint32_t n = 0; n < lines && block.isValid(); ++n) {
+                block = block.next();
+            }
+            character = semanticData[i + 1];
+        } else {
+            character += semanticData[i + 1];
+        }
+        if (!block.isValid()) {
+            break;
+        }
+        auto lineLength = static_cast<uint32_t>(block.length() - 1);
+        if (character >= lineLength) {
+            continue; // the line has changed since
+        }
+        auto length = qMin(semanticData[i + 2], lineLength - character);
+        tokens.append(block.position() + character, length,
+                      static_cast<uint16_t>(semanticData[i + 3]));
+    }
+    return tokens;
+}
+
+QCoro::Task<> CodeEditWidget::closeDocument() {
+    if (!server || !opened) {
+        co_return;
+    }
+    opened = false;
+    pendingChanges.clear();
+    // their coroutines resume once the widget may be gone, and check for it
+    server->cancel(std::exchange(completionRequest, 0));
+    server->cancel(std::exchange(semanticRequest, 0));
+    co_await server->didClose(lspDocument());
+}
+
 void CodeEditWidget::setup() {
     Configs::bindHotUpdateOn(this, "codeFont", &CodeEditWidget::onSetFont);
     Configs::instance().manuallyUpdate("codeFont");
@@ -297,9 +542,9 @@ void CodeEditWidget::keyPressEvent(QKeyEvent *e) {
     QPlainTextEdit::keyPressEvent(e);
     if (e->key() == Qt::Key_Slash && e->modifiers() & Qt::ControlModifier) {
         emit toggleComment();
-        return;
+    } else if (e->key() == Qt::Key_F12 && e->modifiers() & Qt::ShiftModifier) {
+        askForReferences();
     }
-    updateCursorPosition();
 }
 
 void CodeEditWidget::mousePressEvent(QMouseEvent *e) {
@@ -309,57 +554,74 @@ void CodeEditWidget::mousePressEvent(QMouseEvent *e) {
     }
 }
 
-void CodeEditWidget::updateCursorPosition() const {
-    if (auto *highlighter = document()->findChild<QSyntaxHighlighter *>()) {
-        if (auto *hl = dynamic_cast<Highlighter *>(highlighter)) {
-            hl->setCursorPosition(textCursor().position(), textCursor().block());
-        }
-    }
+void CodeEditWidget::adaptViewport() { setViewportMargins(lna->getWidth(), 0, 0, 0); }
+
+bool CompletionSession::covers(int start, const QString &word) const {
+    return wordStart == start && !incomplete && word.startsWith(prefix);
 }
 
-void CodeEditWidget::adaptViewport() { setViewportMargins(lna->getWidth(), 0, 0, 0); }
+QPair<int, QString> CodeEditWidget::wordUnderCursor() const {
+    auto cursor = textCursor();
+    cursor.select(QTextCursor::WordUnderCursor);
+    return {cursor.selectionStart(), cursor.selectedText()};
+}
 
-QCoro::Task<> CodeEditWidget::askForCompletion() const {
-    if (!server) {
+QCoro::Task<> CodeEditWidget::askForCompletion() { co_await requestCompletion(true); }
+
+QCoro::Task<> CodeEditWidget::prefetchCompletion() {
+    auto cursor = textCursor();
+    auto [wordStart, word] = wordUnderCursor();
+    // only at the end of a word, where typing on grows it
+    if (!opened || completionRequest != 0 || cl->isVisible() || cursor.hasSelection() ||
+        cursor.position() != wordStart + word.size() || completionSession.covers(wordStart, word)) {
         co_return;
     }
+    co_await requestCompletion(false);
+}
 
-    // Debounce mechanism
-    static QDateTime lastRequestTime;
-    // Skip if user requested recently (within 300 ms)
-    QDateTime now = QDateTime::currentDateTime();
-    if (lastRequestTime.isValid() && lastRequestTime.msecsTo(now) < 300) {
-        lastRequestTime = now;
+QCoro::Task<> CodeEditWidget::requestCompletion(bool display) {
+    if (!server) {
         co_return;
     }
-    lastRequestTime = now;
+    if (completionRequest != 0) {
+        // superseded, the server can stop working on it
+        server->cancel(std::exchange(completionRequest, 0));
+    }
 
     auto cursor = textCursor();
-    cursor.select(QTextCursor::WordUnderCursor);
-    auto word = cursor.selectedText();
+    auto [wordStart, word] = wordUnderCursor();
     if (word.isEmpty()) {
         co_return;
     }
 
-    if (modified) {
-        co_await server->didOpen(
-                {LSPUri::fromQUrl(file.filePath()), file.language(), toPlainText()});
+    QPointer self(this);
+    co_await syncDocument();
+    if (!self || !opened) {
+        co_return;
     }
-
-    auto completion = co_await server->completion({LSPUri::fromQUrl(file.filePath())},
-                                                  {cursor.blockNumber(), cursor.columnNumber()});
-    for (const auto &item: completion.items) {
-        if (item.insertText == word) {
-            co_return; // The word is finished and do not give completions
-        }
+    int requestVersion = version;
+    auto request = server->completion({LSPUri::fromLocalFile(file.filePath())},
+                                      {cursor.blockNumber(), cursor.columnNumber()}, word);
+    completionRequest = request.id;
+    auto completion = co_await std::move(request.response);
+    if (!self || completionRequest != request.id) {
+        co_return; // cancelled by a newer request, or by closing the document
+    }
+    completionRequest = 0;
+    if (version != requestVersion || !pendingChanges.isEmpty() ||
+        wordUnderCursor().first != wordStart) {
+        co_return; // the text changed meanwhile, a newer request is scheduled
     }
 
+    completionSession = {wordStart, word, completion.incomplete};
     cl->readCompletions(completion);
+    if (!display) {
+        co_return; // shown once the word is typed on
+    }
     auto rect = cursorRect();
     auto pos = mapToGlobal(QPoint(rect.right(), rect.bottom()));
     cl->move(pos);
-
-    co_return;
+    updateCompletionList();
 }
 
 void CodeEditWidget::updateCompletionList() {
@@ -368,7 +630,7 @@ void CodeEditWidget::updateCompletionList() {
     auto word = cursor.selectedText();
     if (word.isEmpty()) {
         cl->hide();
-        requireCompletion = true;
+        completionSession = {};
         return;
     }
     cl->update(word);
@@ -386,7 +648,7 @@ void CodeEditWidget::insertCompletion(const QString &completion) {
     cursor.insertText(completion);
     cl->hide();
     setFocus();
-    requireCompletion = true;
+    completionSession = {};
 }
 
 void CodeEditWidget::onToggleComment() {
@@ -468,16 +730,19 @@ void CodeEditWidget::onToggleComment() {
 }
 
 QCoro::Task<> CodeEditWidget::askForDefinition() {
+    if (!server) {
+        co_return;
+    }
     QTextCursor cursor = textCursor();
 
-    if (modified) {
-        co_await server->didOpen(
-                {LSPUri::fromQUrl(file.filePath()), file.language(), toPlainText()});
+    QPointer self(this);
+    co_await syncDocument();
+    if (!self) {
+        co_return;
     }
-
-    auto definition = co_await server->definition({LSPUri::fromQUrl(file.filePath())},
+    auto definition = co_await server->definition({LSPUri::fromLocalFile(file.filePath())},
                                                   {cursor.blockNumber(), cursor.columnNumber()});
-    if (definition.items.isEmpty()) {
+    if (!self || definition.items.isEmpty()) {
         co_return;
     }
     // just use the first element for test here
@@ -486,6 +751,37 @@ QCoro::Task<> CodeEditWidget::askForDefinition() {
                 end.character);
 }
 
+QCoro::Task<> CodeEditWidget::askForReferences() {
+    if (!server) {
+        co_return;
+    }
+    QTextCursor cursor = textCursor();
+    LSPPosition position{cursor.blockNumber(), cursor.columnNumber()};
+    cursor.select(QTextCursor::WordUnderCursor);
+    QPointer<LocationsWidget> list =
+            new LocationsWidget(tr("引用: %1").arg(cursor.selectedText()), false, this);
+    connect(list, &LocationsWidget::locationActivated, this,
+            [this](const QUrl &url, int line, int character) {
+                emit jumpTo(url, line, character, line, character);
+            });
+    list->show();
+
+    QPointer self(this);
+    co_await syncDocument();
+    if (!self) {
+        co_return; // the list went with the editor
+    }
+    auto chunk = [list](const ReferencesResponse &response) {
+        if (list) {
+            list->addReferences(response);
+        }
+    };
+    co_await server->references({LSPUri::fromLocalFile(file.filePath())}, position, chunk).response;
+    if (list) {
+        list->finish();
+    }
+}
+
 void CodeEditWidget::updateLineNumberArea(const QRect &rect, int dy) {
     if (dy) {
         lna->scroll(0, dy);
@@ -498,12 +794,22 @@ void CodeEditWidget::updateLineNumberArea(const QRect &rect, int dy) {
     }
 }
 
+void CodeEditWidget::updateVisibleRange() const {
+    if (!highlighter) {
+        return;
+    }
+    int from = firstVisibleBlock().position();
+    int to = cursorForPosition(viewport()->rect().bottomRight()).position();
+    highlighter->setVisibleRange(from, to);
+}
+
 const LangFileInfo &CodeEditWidget::getFile() const { return file; }
 
 QString CodeEditWidget::getTabText() const { return file.fileName(); };
 
 void CodeEditWidget::highlightLine() {
-    QList<QTextEdit::ExtraSelection> selections;
+    auto &selections = lineSelections;
+    selections.clear();
     if (!isReadOnly()) {
         QTextEdit::ExtraSelection selection;
         QColor lineColor = QColor(0x222222).lighter(160);
@@ -513,7 +819,72 @@ void CodeEditWidget::highlightLine() {
         selection.cursor.clearSelection();
         selections.append(selection);
     }
-    setExtraSelections(selections);
+    if (highlighter) {
+        // the matching bracket may be on another line
+        if (auto match = highlighter->matchBrackets(textCursor().position())) {
+            for (int position: {match->first, match->second}) {
+                QTextEdit::ExtraSelection selection;
+                selection.format.setFontWeight(QFont::Bold);
+                selection.format.setForeground(QColor(0xFF0000));
+                selection.cursor = QTextCursor(document());
+                selection.cursor.setPosition(position);
+                selection.cursor.setPosition(position + 1, QTextCursor::KeepAnchor);
+                selections.append(selection);
+            }
+        }
+    }
+    setExtraSelections(lineSelections + diagnosticSelections);
+}
+
+void CodeEditWidget::onDiagnosticsChanged(const QString &path) {
+    if (path == file.filePath()) {
+        diagnosticLines = {-1, -1};
+        diagnosticTimer->start();
+    }
+}
+
+void CodeEditWidget::onViewportScrolled() {
+    int firstLine = firstVisibleBlock().blockNumber();
+    int lastLine = cursorForPosition(viewport()->rect().bottomRight()).blockNumber();
+    if (QPair(firstLine, lastLine) != diagnosticLines && !diagnosticTimer->isActive()) {
+        diagnosticTimer->start();
+    }
+}
+
+void CodeEditWidget::paintDiagnostics() {
+    auto table = DiagnosticStore::instance().table(file.filePath());
+    if (table.version && *table.version < version) {
+        return; // outdated, the painted ones have moved along with the text meanwhile
+    }
+    int firstLine = firstVisibleBlock().blockNumber();
+    int lastLine = cursorForPosition(viewport()->rect().bottomRight()).blockNumber();
+    diagnosticLines = {firstLine, lastLine};
+
+    // a position of the server may be past the end of a line that has changed since
+    auto toPosition = [this](const LSPPosition &position) {
+        auto block = document()->findBlockByNumber(position.line);
+        if (!block.isValid()) {
+            return document()->characterCount() - 1;
+        }
+        return block.position() + qMin(position.character, block.length() - 1);
+    };
+    diagnosticSelections.clear();
+    for (const auto &diagnostic: table.overlapping(firstLine, lastLine)) {
+        QTextEdit::ExtraSelection selection;
+        selection.format.setUnderlineStyle(QTextCharFormat::WaveUnderline);
+        QColor color = diagnostic.severity == Diagnostic::Error     ? QColor(0xFF5555)
+                       : diagnostic.severity == Diagnostic::Warning ? QColor(0xE0B000)
+                                                                    : QColor(0x55AAFF);
+        selection.format.setUnderlineColor(color);
+        int start = toPosition(diagnostic.range.start);
+        int end = qMax(toPosition(diagnostic.range.end), start + 1);
+        selection.cursor = QTextCursor(document());
+        selection.cursor.setPosition(start);
+        selection.cursor.setPosition(qMin(end, document()->characterCount() - 1),
+                                     QTextCursor::KeepAnchor);
+        diagnosticSelections.append(selection);
+    }
+    setExtraSelections(lineSelections + diagnosticSelections);
 }
 
 #define MAX_BUFFER_SIZE (1024 * 1024)
@@ -567,16 +938,24 @@ void CodeEditWidget::readFile() {
     check.close();
 }
 
-void CodeEditWidget::saveFile() {
+QCoro::Task<> CodeEditWidget::saveFile() {
     QFile qfile(file.filePath());
     if (!qfile.open(QIODevice::WriteOnly | QIODevice::Text)) {
         QMessageBox::warning(this, "错误",
                              tr("文件 %1 保存失败, 请检查用户权限！").arg(file.filePath()));
-        return;
+        co_return;
     }
     modified = false;
     qfile.write(toPlainText().toUtf8());
     qfile.close();
+    if (server && opened) {
+        // the pending changes go first, didSave refers to the text they lead to
+        QPointer self(this);
+        co_await syncDocument();
+        if (self && opened) {
+            co_await server->didSave(lspDocument());
+        }
+    }
 }
 
 bool CodeEditWidget::askForSave() {
@@ -629,10 +1008,16 @@ QCoro::Task<> CodeEditWidget::onTextChanged() {
         modified = true;
         emit modify();
     }
-    if (requireCompletion) {
-        co_await askForCompletion();
+    // while the word grows, a complete list of its beginning only needs filtering
+    auto [wordStart, word] = wordUnderCursor();
+    if (!completionSession.covers(wordStart, word)) {
+        completionTimer->start(); // restarted by every keystroke until the typing pauses
+    }
+    if (word.isEmpty() || wordStart == completionSession.wordStart) {
+        updateCompletionList();
+    } else {
+        cl->hide(); // the list of another word
     }
-    updateCompletionList();
     co_return;
 }
 
@@ -652,9 +1037,8 @@ void CodeTabWidget::setProject(Project *project) {
 
 void CodeTabWidget::clearAll() {
     for (int i = count() - 1; i >= 0; --i) {
-        removeTab(i);
+        removeCodeEdit(i); // the last one brings the welcome tab back
     }
-    welcome();
 }
 
 void CodeTabWidget::setup() {
@@ -738,6 +1122,10 @@ void CodeTabWidget::removeCodeEdit(int index) {
         return;
 
     QWidget *w = widget(index);
+    if (auto *edit = editAt(index)) {
+        // the server can free what it keeps for the file
+        edit->closeDocument();
+    }
     removeTab(index);
     w->deleteLater();
 
@@ -3,15 +3,30 @@
 
 #include <QListWidget>
 #include <QPlainTextEdit>
+#include <QPointer>
+#include <QTimer>
 #include <qcorotask.h>
 
 #include "../ide/highlighter.h"
 #include "../ide/lsp.h"
 #include "../ide/project.h"
 #include "fileTree.h"
+#include "locations.h"
 
 class CodeEditWidget;
 
+/** The word a completion list was asked for, the list is filtered locally while it grows */
+struct CompletionSession {
+    /** Position of the word in the document, -1 without a session */
+    int wordStart = -1;
+    QString prefix;
+    /** The server may have more items for a longer prefix, so ask again */
+    bool incomplete = true;
+
+    /** The list of the session is all there is for the word at the position */
+    bool covers(int start, const QString &word) const;
+};
+
 class CompletionList : public QListWidget {
     CodeEditWidget *codeEdit;
     QList<CompletionItem> completions;
@@ -73,9 +88,44 @@ class CodeEditWidget : public QPlainTextEdit {
     LineNumberArea *lna;
 
     bool modified;
-    bool requireCompletion;
+    CompletionSession completionSession;
+    /** The completion request on its way, 0 if none, a newer one cancels it */
+    int completionRequest = 0;
+    /** Asks for completion once the typing pauses */
+    QTimer *completionTimer;
+    /** Prefetches the completion of the word under the cursor once the editor is idle */
+    QTimer *prefetchTimer;
+
+    QList<QTextEdit::ExtraSelection> lineSelections;
+    /** Underlines of the diagnostics on the lines [first, second] */
+    QList<QTextEdit::ExtraSelection> diagnosticSelections;
+    QPair<int, int> diagnosticLines = {-1, -1};
+    /** Coalesces the diagnostics updates and scrolls into one repaint per frame */
+    QTimer *diagnosticTimer;
+
+    /** The semantic tokens as the server last sent them, and the id to ask for their changes */
+    QList<uint32_t> semanticData;
+    QString semanticResultId;
+    int semanticRequest = 0;
+    /** Asks for the semantic tokens once the typing pauses, not on every sync */
+    QTimer *semanticTimer;
+
+    // the document as the language server knows it
+    bool opened = false;
+    int version = 1;
+    QString syncedText;
+    /** Changes not sent yet, they go out together before the next request or after a pause */
+    QList<LSPTextChange> pendingChanges;
+    QTimer *syncTimer;
 
     void setup();
+    LSPTextDocument lspDocument() const;
+    /** The position of the word under the cursor, and the word */
+    QPair<int, QString> wordUnderCursor() const;
+    /** Decode the tokens [first, last) of `semanticData`, the first is relative to `anchor` */
+    SpanTable decodeSemanticTokens(qsizetype first, qsizetype last, LSPPosition anchor) const;
+    /** Paint the tokens [first, last), they replace whatever lies between their neighbours */
+    void paintSemanticTokens(qsizetype first, qsizetype last);
 
 private slots:
     /** Async initialization */
@@ -86,14 +136,34 @@ private slots:
     void adaptViewport();
     /** Update the line number area when the content changes */
     void updateLineNumberArea(const QRect &rect, int dy);
-    /** Highlight the line where the cursor is */
+    /** Tell the highlighter which part of the document is on the screen */
+    void updateVisibleRange() const;
+    /** Highlight the line where the cursor is, and the brackets matching around it */
     void highlightLine();
+    /** Underline the diagnostics on the screen */
+    void paintDiagnostics();
+    /** Repaint the diagnostics in the next frame if other lines came on the screen */
+    void onViewportScrolled();
+    /** The diagnostics of a file have been updated */
+    void onDiagnosticsChanged(const QString &path);
     /** What to do when the text is modified */
     QCoro::Task<> onTextChanged();
-    /** Update the cursor position (and tell it to highlighter) */
-    void updateCursorPosition() const;
+    /** Record a change of the text for the language server */
+    void recordChange(int position, int charsRemoved, int charsAdded);
+    /** Send the pending changes to the language server */
+    QCoro::Task<> syncDocument();
+    /** Open the document again in a restarted language server */
+    void reopenDocument();
+    /** Send the pending changes and ask for the changes of the semantic tokens since */
+    QCoro::Task<> updateSemanticTokens();
+    /** Map the token types of the server to the configured formats */
+    void updateSemanticFormats();
     /** Ask the language server for completion */
-    QCoro::Task<> askForCompletion() const;
+    QCoro::Task<> askForCompletion();
+    /** Ask for the completion of the word, shown as the list if `display` */
+    QCoro::Task<> requestCompletion(bool display);
+    /** Fill the completion session of the word under the cursor before it is typed on */
+    QCoro::Task<> prefetchCompletion();
     /** Update the completion list */
     void updateCompletionList();
     /** Insert the given completion */
@@ -102,6 +172,8 @@ private slots:
     void onToggleComment();
     /** Ask the language server for definition */
     QCoro::Task<> askForDefinition();
+    /** Ask the language server for the references, they are listed as they come */
+    QCoro::Task<> askForReferences();
 
 signals:
     void setupFinished();
@@ -123,7 +195,9 @@ public:
     /** Read the file content and display it */
     void readFile();
     /** Save the file content to the file */
-    void saveFile();
+    QCoro::Task<> saveFile();
+    /** Tell the language server the document is no longer open */
+    QCoro::Task<> closeDocument();
     /** Check if the content is modified, if so, ask for save */
     bool askForSave();
     /** Move the cursor to the given position */
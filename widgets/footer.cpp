@@ -23,6 +23,7 @@ void ProgressBarTask::finish() const { FooterWidget::instance().finishTask(*this
 
 FooterWidget::FooterWidget(QWidget *parent) : QFrame(parent), curTaskId(TASK_FREE) {
     fileLabel = new QLabel(this);
+    serverLabel = new QLabel(this);
     progressBar = new QProgressBar(this);
     reminderLabel = new QLabel(this);
     setup();
@@ -34,6 +35,7 @@ void FooterWidget::setup() {
     setFixedHeight(30);
     layout->setContentsMargins(10, 0, 10, 0);
     fileLabel->setStyleSheet("color: #999999");
+    serverLabel->setStyleSheet("color: #999999");
 
     reminderLabel->setText("");
     progressBar->setMaximumWidth(250);
@@ -42,6 +44,7 @@ void FooterWidget::setup() {
 
     layout->addWidget(fileLabel);
     layout->addStretch(1);
+    layout->addWidget(serverLabel);
     layout->addWidget(reminderLabel);
     layout->addWidget(progressBar);
 
@@ -59,6 +62,8 @@ void FooterWidget::clear() const { fileLabel->setText(""); }
 
 void FooterWidget::setFileLabel(const QString &text) const { fileLabel->setText(text); }
 
+void FooterWidget::setServerLabel(const QString &text) const { serverLabel->setText(text); }
+
 ProgressBarTask FooterWidget::newTask(const QString &text, int max) { return ProgressBarTask(text, max); }
 
 void FooterWidget::waitTask(const ProgressBarTask &task, const QString &newText) { updateTask(task, 0, newText); }
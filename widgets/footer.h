@@ -24,6 +24,7 @@ class FooterWidget : public QFrame {
     Q_OBJECT
 
     QLabel *fileLabel;
+    QLabel *serverLabel;
     QLabel *reminderLabel;
     QProgressBar *progressBar;
     int curTaskId; // set -1 to be no task
@@ -36,6 +37,8 @@ public:
     static FooterWidget &instance();
     void clear() const;
     void setFileLabel(const QString &text) const;
+    /** Show the memory and latency of the language servers */
+    void setServerLabel(const QString &text) const;
 
     /** Generate a new task. */
     static ProgressBarTask newTask(const QString &text = "", int max = 0);
@@ -0,0 +1,129 @@
+#include "locations.h"
+
+#include <QFileInfo>
+#include <QVBoxLayout>
+
+LocationModel::LocationModel(QObject *parent) : QAbstractListModel(parent) {}
+
+int LocationModel::rowCount(const QModelIndex &parent) const {
+    return parent.isValid() ? 0 : static_cast<int>(entries.size());
+}
+
+QVariant LocationModel::data(const QModelIndex &index, int role) const {
+    if (!index.isValid() || index.row() >= entries.size()) {
+        return {};
+    }
+    const auto &entry = entries[index.row()];
+    switch (role) {
+        case Qt::DisplayRole:
+            return entry.title;
+        case Qt::ToolTipRole:
+            return entry.url.path();
+        default:
+            return {};
+    }
+}
+
+const LocationEntry &LocationModel::entry(int row) const { return entries[row]; }
+
+void LocationModel::append(const QList<LocationEntry> &chunk) {
+    if (chunk.isEmpty()) {
+        return;
+    }
+    // one insertion per chunk, the view only lays out what is on the screen
+    auto first = static_cast<int>(entries.size());
+    beginInsertRows({}, first, first + static_cast<int>(chunk.size()) - 1);
+    entries.append(chunk);
+    endInsertRows();
+}
+
+void LocationModel::clear() {
+    beginResetModel();
+    entries.clear();
+    endResetModel();
+}
+
+LocationsWidget::LocationsWidget(const QString &title, bool searchable, QWidget *parent) :
+    QDialog(parent) {
+    setWindowTitle(title);
+    setMinimumSize(600, 400);
+    setAttribute(Qt::WA_DeleteOnClose);
+
+    model = new LocationModel(this);
+    view = new QListView(this);
+    view->setModel(model);
+    view->setUniformItemSizes(true);
+    view->setEditTriggers(QAbstractItemView::NoEditTriggers);
+    status = new QLabel(this);
+    connect(view, &QListView::activated, this, &LocationsWidget::onActivated);
+
+    auto *layout = new QVBoxLayout(this);
+    if (searchable) {
+        search = new QLineEdit(this);
+        search->setPlaceholderText(tr("输入符号名称"));
+        searchTimer = new QTimer(this);
+        searchTimer->setSingleShot(true);
+        searchTimer->setInterval(150);
+        connect(search, &QLineEdit::textChanged, searchTimer, qOverload<>(&QTimer::start));
+        connect(searchTimer, &QTimer::timeout, this, [this] {
+            clear();
+            emit searchChanged(search->text());
+        });
+        layout->addWidget(search);
+    }
+    layout->addWidget(view);
+    layout->addWidget(status);
+    updateStatus();
+}
+
+void LocationsWidget::addReferences(const ReferencesResponse &chunk) {
+    QList<LocationEntry> entries;
+    entries.reserve(chunk.items.size());
+    for (const auto &item: chunk.items) {
+        auto url = item.uri.toQUrl();
+        entries.append({QString("%1:%2:%3")
+                                .arg(QFileInfo(url.path()).fileName())
+                                .arg(item.range.start.line + 1)
+                                .arg(item.range.start.character + 1),
+                        url, item.range});
+    }
+    model->append(entries);
+    updateStatus();
+}
+
+void LocationsWidget::addSymbols(const WorkspaceSymbolResponse &chunk) {
+    QList<LocationEntry> entries;
+    entries.reserve(chunk.items.size());
+    for (const auto &item: chunk.items) {
+        auto url = item.location.uri.toQUrl();
+        auto name = item.container.isEmpty() ? item.name
+                                             : QString("%1 (%2)").arg(item.name, item.container);
+        entries.append({QString("%1    %2:%3")
+                                .arg(name, QFileInfo(url.path()).fileName())
+                                .arg(item.location.range.start.line + 1),
+                        url, item.location.range});
+    }
+    model->append(entries);
+    updateStatus();
+}
+
+void LocationsWidget::finish() {
+    finished = true;
+    updateStatus();
+}
+
+void LocationsWidget::clear() {
+    finished = false;
+    model->clear();
+    updateStatus();
+}
+
+void LocationsWidget::updateStatus() {
+    auto count = model->rowCount();
+    status->setText(finished ? tr("共 %1 个结果").arg(count) : tr("正在查找… %1").arg(count));
+}
+
+void LocationsWidget::onActivated(const QModelIndex &index) {
+    const auto &entry = model->entry(index.row());
+    emit locationActivated(entry.url, entry.range.start.line, entry.range.start.character);
+}
@@ -0,0 +1,68 @@
+#ifndef LOCATIONS_H
+#define LOCATIONS_H
+
+#include <QAbstractListModel>
+#include <QDialog>
+#include <QLabel>
+#include <QLineEdit>
+#include <QListView>
+#include <QTimer>
+#include <QUrl>
+
+#include "../ide/lsp.h"
+
+struct LocationEntry {
+    QString title;
+    QUrl url;
+    LSPRange range;
+};
+
+/** A flat list of locations that grows as the chunks of a result come in */
+class LocationModel : public QAbstractListModel {
+    Q_OBJECT
+
+    QList<LocationEntry> entries;
+
+public:
+    explicit LocationModel(QObject *parent = nullptr);
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role) const override;
+    const LocationEntry &entry(int row) const;
+    void append(const QList<LocationEntry> &chunk);
+    void clear();
+};
+
+/**
+ * The results of a references or symbol search, shown while they stream in.
+ * Only the visible rows of the list are laid out, so long results stay cheap.
+ */
+class LocationsWidget : public QDialog {
+    Q_OBJECT
+
+    LocationModel *model;
+    QListView *view;
+    QLineEdit *search = nullptr;
+    QLabel *status;
+    /** Wait for a pause in typing before searching */
+    QTimer *searchTimer = nullptr;
+    bool finished = false;
+
+    void updateStatus();
+    void onActivated(const QModelIndex &index);
+
+signals:
+    void locationActivated(const QUrl &url, int line, int character);
+    /** The query of the search box has changed, the old results are cleared */
+    void searchChanged(const QString &query);
+
+public:
+    /** With `searchable`, a search box on top asks for new results */
+    explicit LocationsWidget(const QString &title, bool searchable, QWidget *parent = nullptr);
+    void addReferences(const ReferencesResponse &chunk);
+    void addSymbols(const WorkspaceSymbolResponse &chunk);
+    /** No more chunks will come */
+    void finish();
+    void clear();
+};
+
+#endif // LOCATIONS_H
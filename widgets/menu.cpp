@@ -39,6 +39,9 @@ void MenuBarWidget::setup() {
     // Edit menu
     QMenu *editMenu = this->addMenu("编辑");
     newAction(editMenu, "设置", QKeySequence(Qt::Key_F5), &MenuBarWidget::openSettings);
+    newAction(editMenu, "语言服务器日志", QKeySequence(), &MenuBarWidget::openServerLogs);
+    newAction(editMenu, "查找符号", QKeySequence(Qt::CTRL | Qt::Key_T),
+              &MenuBarWidget::openSymbolSearch);
 
     // OJ menu
     QMenu *ojMenu = this->addMenu("OpenJudge");
@@ -25,6 +25,10 @@ signals:
     void newFolder();
     /** Open the settings */
     void openSettings();
+    /** Show what the language servers wrote to stderr */
+    void openServerLogs();
+    /** Search the symbols of the workspace */
+    void openSymbolSearch();
     /** Login to OJ */
     void loginOJ();
     /** Download from OJ */
@@ -0,0 +1,39 @@
+#include "serverLog.h"
+
+#include <QPlainTextEdit>
+#include <QPushButton>
+#include <QScrollBar>
+#include <QVBoxLayout>
+
+#include "../ide/lsp.h"
+
+ServerLogDialog::ServerLogDialog(QWidget *parent) : QDialog(parent) {
+    setWindowTitle(tr("语言服务器日志"));
+    setMinimumSize(800, 500);
+    tabs = new QTabWidget(this);
+    auto *refreshButton = new QPushButton(tr("刷新"), this);
+    connect(refreshButton, &QPushButton::clicked, this, &ServerLogDialog::refresh);
+
+    auto *layout = new QVBoxLayout(this);
+    layout->addWidget(tabs);
+    layout->addWidget(refreshButton, 0, Qt::AlignRight);
+    refresh();
+}
+
+void ServerLogDialog::refresh() const {
+    auto current = tabs->currentIndex();
+    while (tabs->count() > 0) {
+        auto *page = tabs->widget(0);
+        tabs->removeTab(0);
+        page->deleteLater();
+    }
+    for (auto *server: LanguageServerPool::instance().all()) {
+        auto *view = new QPlainTextEdit(tabs);
+        view->setReadOnly(true);
+        view->setLineWrapMode(QPlainTextEdit::NoWrap);
+        view->setPlainText(server->log());
+        view->verticalScrollBar()->setValue(view->verticalScrollBar()->maximum());
+        tabs->addTab(view, server->name());
+    }
+    tabs->setCurrentIndex(current);
+}
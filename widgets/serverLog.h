@@ -0,0 +1,19 @@
+#ifndef SERVER_LOG_H
+#define SERVER_LOG_H
+
+#include <QDialog>
+#include <QTabWidget>
+
+/** The stderr of each language server, as kept in its ring buffer */
+class ServerLogDialog : public QDialog {
+    Q_OBJECT
+
+    QTabWidget *tabs;
+
+    void refresh() const;
+
+public:
+    explicit ServerLogDialog(QWidget *parent = nullptr);
+};
+
+#endif // SERVER_LOG_H
@@ -24,6 +24,15 @@ void bindConfig(W *widget, const QString &key, void (W::*setterSlot)(const V &),
                      [key](const V &newValue) { Configs::instance().set(key, newValue); });
 }
 
+/** For the widgets whose setter and signal take the value by copy, like a check box */
+template<class W, class V>
+void bindConfig(W *widget, const QString &key, void (W::*setterSlot)(V), void (W::*changedSignal)(V)) {
+    auto value = Configs::instance().get(key).toVariant().value<V>();
+    (widget->*setterSlot)(value);
+    QObject::connect(widget, changedSignal, widget,
+                     [key](V newValue) { Configs::instance().set(key, newValue); });
+}
+
 class AppearancePage : public QWidget {
 
 #define FONT_KEY "codeFont"
@@ -148,7 +157,22 @@ public:
         cmdGroup->setLayout(cmdLayout);
         bindConfig(this, RUN_CMD_KEY, &RunningPage::setRunCmd, &RunningPage::runCmdChanged);
 
+        auto *serverGroup = new QGroupBox(tr("语言服务器"), this);
+        auto *serverLayout = new QVBoxLayout(serverGroup);
+        serverLayout->addWidget(new QLabel(tr("日志级别"), serverGroup));
+        auto *logLevelCombo = new QComboBox(serverGroup);
+        logLevelCombo->addItems({"error", "info", "verbose"});
+        bindConfig(logLevelCombo, "lspLogLevel", &QComboBox::setCurrentText, &QComboBox::currentTextChanged);
+        serverLayout->addWidget(logLevelCombo);
+        // read when a server starts, so it applies from the next start on
+        auto *recordCheck = new QCheckBox(tr("记录通信 (服务器重启后生效)"), serverGroup);
+        bindConfig<QAbstractButton, bool>(recordCheck, "lspRecordTraffic",
+                                          &QAbstractButton::setChecked, &QAbstractButton::toggled);
+        serverLayout->addWidget(recordCheck);
+        serverGroup->setLayout(serverLayout);
+
         layout->addWidget(cmdGroup);
+        layout->addWidget(serverGroup);
         layout->addStretch();
     }
 };
@@ -5,6 +5,7 @@
 #include <QSplitter>
 
 #include "../util/file.h"
+#include "serverLog.h"
 #include "setting.h"
 #include "preview.h"
 #include "aiAssistant.h"
@@ -108,6 +109,8 @@ void IDEMainWindow::connectSignals() {
 
     // Edit
     connect(menuBar, &MenuBarWidget::openSettings, this, &IDEMainWindow::openSettings);
+    connect(menuBar, &MenuBarWidget::openServerLogs, this, &IDEMainWindow::openServerLogs);
+    connect(menuBar, &MenuBarWidget::openSymbolSearch, this, &IDEMainWindow::openSymbolSearch);
 
     // OJ
     connect(menuBar, &MenuBarWidget::downloadOJ, ojPreview,
@@ -120,6 +123,10 @@ void IDEMainWindow::connectSignals() {
     connect(menuBar, &MenuBarWidget::loginOJ, ojPreview, &OpenJudgePreviewWidget::loginOJ);
     connect(menuBar, &MenuBarWidget::submitOJ, this, &IDEMainWindow::submitCurrentCode);
     connect(ojPreview, &OpenJudgePreviewWidget::loginAs, menuBar, &MenuBarWidget::onLogin);
+
+    // Language servers
+    connect(&LanguageServerPool::instance(), &LanguageServerPool::statsChanged, footer,
+            &FooterWidget::setServerLabel);
 }
 
 void IDEMainWindow::openFolder(const QString &folder) const {
@@ -130,6 +137,8 @@ void IDEMainWindow::openFolder(const QString &folder) const {
     fileTree->setRoot(project.getRoot());
     ojPreview->clear();
     terminal->setProject(&ide->curProject());
+    LanguageServers::setWorkspace(project.getRoot());
+    IDE::preload(project);
 }
 
 void IDEMainWindow::openSettings() {
@@ -137,6 +146,54 @@ void IDEMainWindow::openSettings() {
     settings->exec();
 }
 
+void IDEMainWindow::openServerLogs() {
+    auto logs = new ServerLogDialog(this);
+    logs->exec();
+}
+
+void IDEMainWindow::openSymbolSearch() {
+    auto *list = new LocationsWidget(tr("查找符号"), true, this);
+    connect(list, &LocationsWidget::searchChanged, this,
+            [this, list](const QString &query) { searchSymbols(list, query); });
+    connect(list, &LocationsWidget::locationActivated, codeTab,
+            [this](const QUrl &url, int line, int character) {
+                codeTab->jumpTo(url, line, character, line, character);
+            });
+    list->show();
+}
+
+QCoro::Task<> IDEMainWindow::searchSymbols(QPointer<LocationsWidget> list, QString query) {
+    for (auto [server, id]: symbolRequests) {
+        server->cancel(id);
+    }
+    symbolRequests.clear();
+    auto search = ++symbolSearch;
+    if (query.isEmpty()) {
+        list->finish();
+        co_return;
+    }
+    // a chunk of a cancelled request may still be on its way
+    auto chunk = [this, list, search](const WorkspaceSymbolResponse &response) {
+        if (list && search == symbolSearch) {
+            list->addSymbols(response);
+        }
+    };
+    std::vector<QCoro::Task<>> tasks;
+    for (auto *server: LanguageServerPool::instance().all()) {
+        if (server->isRunning()) {
+            auto request = server->workspaceSymbols(query, chunk);
+            symbolRequests.append({server, request.id});
+            tasks.push_back(std::move(request.response));
+        }
+    }
+    for (auto &task: tasks) {
+        co_await std::move(task);
+    }
+    if (list && search == symbolSearch) {
+        list->finish();
+    }
+}
+
 void IDEMainWindow::runCurrentCode() const {
     // awake the terminal
     terminal->setVisible(true);
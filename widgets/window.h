@@ -2,12 +2,14 @@
 #define IDE_MAIN_WINDOW_H
 
 #include <QMainWindow>
+#include <QPointer>
 
 #include "../ide/ide.h"
 #include "code.h"
 #include "fileTree.h"
 #include "footer.h"
 #include "iconNav.h"
+#include "locations.h"
 #include "menu.h"
 #include "preview.h"
 #include "terminal.h"
@@ -28,8 +30,13 @@ class IDEMainWindow : public QMainWindow {
     FooterWidget *footer;
     AIAssistantWidget *aiAssistant;
 
+    /** The symbol requests of the last query, cancelled when the query changes */
+    QList<QPair<LanguageServer *, int>> symbolRequests;
+    int symbolSearch = 0;
+
     void setup();
     void connectSignals();
+    QCoro::Task<> searchSymbols(QPointer<LocationsWidget> list, QString query);
 
 public:
     explicit IDEMainWindow(QWidget *parent = nullptr);
@@ -37,6 +44,8 @@ public:
 public slots:
     void openFolder(const QString &folder) const;
     void openSettings();
+    void openServerLogs();
+    void openSymbolSearch();
     void runCurrentCode() const;
     void submitCurrentCode() const;
 };